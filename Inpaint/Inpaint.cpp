@@ -0,0 +1,618 @@
+/*
+   OFX Inpaint plugin.
+
+   Copyright (C) 2014 INRIA
+
+   Redistribution and use in source and binary forms, with or without modification,
+   are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+   Redistributions in binary form must reproduce the above copyright notice, this
+   list of conditions and the following disclaimer in the documentation and/or
+   other materials provided with the distribution.
+
+   Neither the name of the {organization} nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   INRIA
+   Domaine de Voluceau
+   Rocquencourt - B.P. 105
+   78153 Le Chesnay Cedex - France
+
+
+   The skeleton for this source file is from:
+   OFX Invert Example plugin, a plugin that illustrates the use of the OFX Support library.
+
+   Copyright (C) 2007 The Open Effects Association Ltd
+   Author Bruno Nicoletti bruno@thefoundry.co.uk
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name The Open Effects Association Ltd, nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The Open Effects Association Ltd
+   1 Wardour St
+   London W1D 6PA
+   England
+
+
+ */
+
+#include "GenericOpenCVPlugin.h"
+
+#include <ofxsLut.h>
+#include "ofxsPixelProcessor.h"
+
+#include <opencv2/photo/photo.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
+using namespace OFX;
+
+OFXS_NAMESPACE_ANONYMOUS_ENTER;
+
+// declared in this namespace so that they are not ambiguous with cv::Mutex
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+#define kPluginName "InpaintOFX"
+#define kPluginGrouping "Filter"
+#define kPluginDescription "Fill the black pixels of the input by inpainting them from their surroundings, using OpenCV.\n" \
+    "Ported from the cvInpaint plugin of opencv2fx by Bernd Porr."
+#define kPluginIdentifier "net.sf.openfx.Inpaint"
+#define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
+#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+
+#define kSupportsTiles 1
+#define kSupportsMultiResolution 1
+#define kSupportsRenderScale 1
+#define kRenderThreadSafety eRenderFullySafe
+
+#define kParamRadius "radius"
+#define kParamRadiusLabel "Radius"
+#define kParamRadiusHint "Radius, in pixels, of the neighborhood of each inpainted pixel that is used to fill it"
+
+#define kParamDilation "dilation"
+#define kParamDilationLabel "Dilation"
+#define kParamDilationHint "Size, in pixels, by which the mask of the black pixels is grown, so that the intact pixels on the boundary of the holes are also inpainted"
+
+#define kParamNoise "noise"
+#define kParamNoiseLabel "Noise"
+#define kParamNoiseHint "Amount of noise added to the inpainted pixels, to fake camera noise"
+
+// the smallest band a mask region is cut into for the render threads
+#define kMinBandHeight 64
+
+// the noise is drawn for cells of 2^kNoiseCellShift pixels, and is at most kNoiseAmplitude 8-bit levels at Noise = 1
+#define kNoiseCellShift 1
+#define kNoiseAmplitude 5.
+
+// the margin of known pixels around the mask that the inpainting of a given radius reads
+static int
+inpaintMargin(double radius)
+{
+    return (int)std::ceil(radius) + 1;
+}
+
+static void
+intersectRects(const OfxRectI & a,
+               const OfxRectI & b,
+               OfxRectI* r)
+{
+    r->x1 = std::max(a.x1, b.x1);
+    r->x2 = std::max( r->x1, std::min(a.x2, b.x2) );
+    r->y1 = std::max(a.y1, b.y1);
+    r->y2 = std::max( r->y1, std::min(a.y2, b.y2) );
+}
+
+// a hash of the pixel coordinates and the frame, from which the noise of a pixel is drawn
+static inline unsigned int
+noiseHash(int x,
+          int y,
+          unsigned int frame)
+{
+    unsigned int h = (unsigned int)x * 0x8da6b343u ^ (unsigned int)y * 0xd8163841u ^ frame * 0xcb1ab31fu;
+
+    // the finalizer of MurmurHash3
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/**
+ * @brief Inpaints parts of an 8-bit RGB image concurrently, using the threads of the host.
+ * Each tile is inpainted as a whole, but only its rows [writeY1, writeY2) are written to the result, so that
+ * tiles may overlap as long as their written rows do not.
+ **/
+class InpaintProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    // the matrices must stay valid until process() returns
+    InpaintProcessor(const cv::Mat & rgb,
+                     const cv::Mat & mask,
+                     double radius,
+                     cv::Mat* result)
+    : _rgb(rgb)
+    , _mask(mask)
+    , _radius(radius)
+    , _result(result)
+    , _tiles()
+    , _mutex()
+    , _failed(false)
+    {
+    }
+
+    void addTile(const cv::Rect & area,
+                 int writeY1,
+                 int writeY2)
+    {
+        Tile tile;
+
+        tile.area = area;
+        tile.writeY1 = writeY1;
+        tile.writeY2 = writeY2;
+        _tiles.push_back(tile);
+    }
+
+    /**
+     * @brief Add the given regions, cut in horizontal bands when there are fewer regions than CPUs. Each band is
+     * inpainted with halo rows above and below it, so that the bands mostly agree where they meet.
+     **/
+    void addRegions(const std::vector<cv::Rect> & regions,
+                    int halo)
+    {
+        const unsigned int nCPUs = OFX::MultiThread::getNumCPUs();
+        unsigned int bandsPerRegion = 1;
+
+        if ( !regions.empty() && (regions.size() < nCPUs) ) {
+            bandsPerRegion = (unsigned int)( (nCPUs + regions.size() - 1) / regions.size() );
+        }
+        for (std::size_t i = 0; i < regions.size(); ++i) {
+            const cv::Rect & r = regions[i];
+            const int bandHeight = std::max( kMinBandHeight, (int)( (r.height + bandsPerRegion - 1) / bandsPerRegion ) );
+            for (int y = r.y; y < r.y + r.height; y += bandHeight) {
+                const int writeY2 = std::min(y + bandHeight, r.y + r.height);
+                const int y1 = std::max(r.y, y - halo);
+                const int y2 = std::min(r.y + r.height, writeY2 + halo);
+                addTile(cv::Rect(r.x, y1, r.width, y2 - y1), y, writeY2);
+            }
+        }
+    }
+
+    void process()
+    {
+        if ( _tiles.empty() ) {
+            return;
+        }
+        // the largest tiles go first, to balance the threads
+        std::stable_sort(_tiles.begin(), _tiles.end(), isLarger);
+        multiThread( std::min( OFX::MultiThread::getNumCPUs(), (unsigned int)_tiles.size() ) );
+        if (_failed) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+
+private:
+    struct Tile
+    {
+        cv::Rect area;
+        int writeY1;
+        int writeY2;
+    };
+
+    static bool isLarger(const Tile & a,
+                         const Tile & b)
+    {
+        return a.area.area() > b.area.area();
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        // the host may give us less threads than we asked for
+        for (std::size_t i = threadID; i < _tiles.size(); i += nThreads) {
+            try {
+                const Tile & tile = _tiles[i];
+                cv::Mat inpainted;
+                cv::inpaint(_rgb(tile.area), _mask(tile.area), inpainted, _radius, cv::INPAINT_TELEA);
+                const cv::Rect written(0, tile.writeY1 - tile.area.y, tile.area.width, tile.writeY2 - tile.writeY1);
+                inpainted(written).copyTo( (*_result)( cv::Rect(tile.area.x, tile.writeY1, tile.area.width, written.height) ) );
+            } catch (...) {
+                // exceptions must not cross the host threads
+                AutoMutex l(_mutex);
+                _failed = true;
+            }
+        }
+    }
+
+    const cv::Mat & _rgb;
+    const cv::Mat & _mask;
+    double _radius;
+    cv::Mat* _result;
+    std::vector<Tile> _tiles;
+    Mutex _mutex;
+    bool _failed;
+};
+
+/**
+ * @brief Writes the output: the source pixels outside of the mask, and the inpainted pixels, converted from 8-bit sRGB
+ * and with their noise, inside it. The rows are split across the threads of the host.
+ **/
+class InpaintWriter
+    : public OFX::ImageProcessor
+{
+public:
+    InpaintWriter(OFX::ImageEffect & instance,
+                  const OFX::Color::Lut* lut)
+    : OFX::ImageProcessor(instance)
+    , _lut(lut)
+    , _srcImg(NULL)
+    , _result(NULL)
+    , _mask(NULL)
+    , _noiseScale(0)
+    , _frame(0)
+    {
+        _bounds.x1 = _bounds.y1 = _bounds.x2 = _bounds.y2 = 0;
+    }
+
+    void setSrcImg(const OFX::Image* src)
+    {
+        _srcImg = src;
+    }
+
+    // the CV_8UC3 inpainted image and the CV_8UC1 mask, covering bounds
+    void setInpainting(const cv::Mat* result,
+                       const cv::Mat* mask,
+                       const OfxRectI & bounds)
+    {
+        _result = result;
+        _mask = mask;
+        _bounds = bounds;
+    }
+
+    void setNoise(double noise,
+                  unsigned int frame)
+    {
+        // the noise is (hash - 512) * _noiseScale / 2^17, for a 10 bit hash. Noise is at most 1, so that this fits in 32 bits
+        _noiseScale = (int)(std::max(0., std::min(noise, 1.) ) * kNoiseAmplitude * 256. + 0.5);
+        _frame = frame;
+    }
+
+private:
+    virtual void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        const int dstComponents = _dstImg->getPixelComponentCount();
+        const int srcComponents = _srcImg ? _srcImg->getPixelComponentCount() : 0;
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+            float* dst = (float*)_dstImg->getPixelAddress(procWindow.x1, y);
+            assert(dst);
+            const bool inBounds = _result && _bounds.y1 <= y && y < _bounds.y2;
+            const unsigned char* maskRow = inBounds ? _mask->ptr<unsigned char>(y - _bounds.y1) : NULL;
+            const unsigned char* resultRow = inBounds ? _result->ptr<unsigned char>(y - _bounds.y1) : NULL;
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dst += dstComponents) {
+                if ( maskRow && (_bounds.x1 <= x) && (x < _bounds.x2) && maskRow[x - _bounds.x1] ) {
+                    const unsigned char* rgb = resultRow + 3 * (x - _bounds.x1);
+                    int a = 0;
+                    if (_noiseScale > 0) {
+                        const int h = (int)(noiseHash(x >> kNoiseCellShift, y >> kNoiseCellShift, _frame) & 0x3ff);
+                        a = ( (h - 512) * _noiseScale + (1 << 16) ) >> 17;
+                    }
+                    for (int c = 0; c < 3; ++c) {
+                        const int v = std::max( 0, std::min(rgb[c] + a, 255) );
+                        dst[c] = _lut->fromColorSpaceUint8ToLinearFloatFast( (unsigned char)v );
+                    }
+                    if (dstComponents == 4) {
+                        dst[3] = 1.f;
+                    }
+                    continue;
+                }
+                const float* src = _srcImg ? (const float*)_srcImg->getPixelAddress(x, y) : NULL;
+                for (int c = 0; c < dstComponents; ++c) {
+                    if (!src) {
+                        dst[c] = 0.f;
+                    } else if (c < srcComponents) {
+                        dst[c] = src[c];
+                    } else {
+                        // RGB source, RGBA output
+                        dst[c] = 1.f;
+                    }
+                }
+            }
+        }
+    }
+
+    const OFX::Color::Lut* _lut;
+    const OFX::Image* _srcImg;
+    const cv::Mat* _result;
+    const cv::Mat* _mask;
+    OfxRectI _bounds;
+    int _noiseScale;
+    unsigned int _frame;
+};
+
+static OFX::Color::LutManager<Mutex>* gLutManager;
+
+
+class InpaintPlugin
+    : public GenericOpenCVPlugin
+{
+public:
+    /** @brief ctor */
+    InpaintPlugin(OfxImageEffectHandle handle)
+    : GenericOpenCVPlugin( handle, gLutManager->sRGBLut() )
+    , _radius(0)
+    , _dilation(0)
+    , _noise(0)
+    {
+        _radius = fetchDoubleParam(kParamRadius);
+        _dilation = fetchIntParam(kParamDilation);
+        _noise = fetchDoubleParam(kParamNoise);
+        assert(_radius && _dilation && _noise);
+    }
+
+private:
+    /* Override the render */
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    // override the roi call, to add the margin read by the inpainting
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    // the radius and dilation at time, in pixels at the render scale
+    void getInpaintParams(double time, const OfxPointD & renderScale, double* radius, int* dilation);
+
+private:
+    DoubleParam* _radius;
+    IntParam* _dilation;
+    DoubleParam* _noise;
+};
+
+void
+InpaintPlugin::getInpaintParams(double time,
+                                const OfxPointD & renderScale,
+                                double* radius,
+                                int* dilation)
+{
+    int dilation_i;
+
+    _radius->getValueAtTime(time, *radius);
+    _dilation->getValueAtTime(time, dilation_i);
+    *radius *= renderScale.x;
+    *dilation = (int)std::floor(dilation_i * renderScale.x + 0.5);
+}
+
+// the overridden render function
+void
+InpaintPlugin::render(const OFX::RenderArguments &args)
+{
+    std::auto_ptr<OFX::Image> dst( _dstClip->fetchImage(args.time) );
+
+    if ( !dst.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if ( (dst->getRenderScale().x != args.renderScale.x) ||
+         ( dst->getRenderScale().y != args.renderScale.y) ||
+         ( dst->getField() != args.fieldToRender) ) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    std::auto_ptr<const OFX::Image> src( (_srcClip && _srcClip->isConnected()) ?
+                                         _srcClip->fetchImage(args.time) : 0 );
+
+    double radius;
+    int dilation;
+    getInpaintParams(args.time, args.renderScale, &radius, &dilation);
+    double noise;
+    _noise->getValueAtTime(args.time, noise);
+    const int margin = inpaintMargin(radius);
+
+    // only the render window and the margin that influences it are processed
+    OfxRectI window = args.renderWindow;
+    window.x1 -= margin + dilation;
+    window.x2 += margin + dilation;
+    window.y1 -= margin + dilation;
+    window.y2 += margin + dilation;
+    if ( src.get() ) {
+        intersectRects(src->getBounds(), window, &window);
+    }
+
+    CVImageWrapper rgbImg;
+    cv::Mat rgb, mask, result;
+    if ( src.get() && (window.x1 < window.x2) && (window.y1 < window.y2) ) {
+        fetchCVImage8U(src.get(), window, true, &rgbImg, ePixelComponentRGB, 3);
+#if CV_MAJOR_VERSION >= 3
+        rgb = *rgbImg.getCvMat();
+#else
+        rgb = cv::Mat(rgbImg.getIplImage(), false /*copyData*/);
+#endif
+
+        // the pixels that are black in 8-bit sRGB are inpainted
+        cv::cvtColor(rgb, mask, cv::COLOR_RGB2GRAY);
+        cv::threshold(mask, mask, 0, 255, cv::THRESH_BINARY_INV);
+        if (dilation > 0) {
+            cv::dilate( mask, mask, cv::Mat(), cv::Point(-1, -1), dilation );
+        }
+
+        // each connected region of the mask is inpainted on its own, and only if it reaches the render window
+        std::vector<cv::Rect> allRegions, regions;
+        maskRegions(mask, margin, &allRegions);
+        const cv::Rect renderRect(args.renderWindow.x1 - window.x1, args.renderWindow.y1 - window.y1,
+                                  args.renderWindow.x2 - args.renderWindow.x1, args.renderWindow.y2 - args.renderWindow.y1);
+        for (std::size_t i = 0; i < allRegions.size(); ++i) {
+            if ( (allRegions[i] & renderRect).area() > 0 ) {
+                regions.push_back(allRegions[i]);
+            }
+        }
+
+        result.create(rgb.size(), CV_8UC3);
+        InpaintProcessor processor(rgb, mask, radius, &result);
+        processor.addRegions(regions, margin + dilation);
+        processor.process();
+    }
+
+    InpaintWriter writer(*this, _srgbLut);
+    writer.setSrcImg( src.get() );
+    if ( !result.empty() ) {
+        writer.setInpainting(&result, &mask, window);
+    }
+    writer.setNoise( noise, (unsigned int)(int)std::floor(args.time + 0.5) );
+    writer.setDstImg( dst.get() );
+    writer.setRenderWindow(args.renderWindow);
+    writer.process();
+} // render
+
+void
+InpaintPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                    OFX::RegionOfInterestSetter &rois)
+{
+    if (!_srcClip) {
+        return;
+    }
+    double radius;
+    int dilation;
+    getInpaintParams(args.time, args.renderScale, &radius, &dilation);
+
+    // the halo is in pixels at the render scale, convert it to canonical coordinates
+    const double halo = inpaintMargin(radius) + dilation;
+    const double par = _srcClip->getPixelAspectRatio();
+    OfxRectD roi = args.regionOfInterest;
+    roi.x1 -= halo * par / args.renderScale.x;
+    roi.x2 += halo * par / args.renderScale.x;
+    roi.y1 -= halo / args.renderScale.y;
+    roi.y2 += halo / args.renderScale.y;
+    rois.setRegionOfInterest(*_srcClip, roi);
+}
+
+mDeclarePluginFactory(InpaintPluginFactory,  { gLutManager = new OFX::Color::LutManager<Mutex>; }, { delete gLutManager; });
+
+using namespace OFX;
+void
+InpaintPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
+{
+    genericCVDescribe(kPluginName, kPluginGrouping, kPluginDescription, kSupportsTiles, kSupportsMultiResolution, false, kRenderThreadSafety, desc);
+}
+
+void
+InpaintPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
+                                        OFX::ContextEnum context)
+{
+    // Source clip only in the filter context
+    // create the mandated source clip
+    ClipDescriptor *srcClip = desc.defineClip(kOfxImageEffectSimpleSourceClipName);
+
+    srcClip->addSupportedComponent(ePixelComponentRGBA);
+    srcClip->addSupportedComponent(ePixelComponentRGB);
+    srcClip->setTemporalClipAccess(false);
+    srcClip->setSupportsTiles(kSupportsTiles);
+    srcClip->setIsMask(false);
+
+    // create the mandated output clip
+    ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
+    dstClip->addSupportedComponent(ePixelComponentRGBA);
+    dstClip->addSupportedComponent(ePixelComponentRGB);
+    dstClip->setSupportsTiles(kSupportsTiles);
+
+
+    // make some pages and to things in
+    PageParamDescriptor *page = desc.definePageParam("Controls");
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamRadius);
+        param->setLabels(kParamRadiusLabel, kParamRadiusLabel, kParamRadiusLabel);
+        param->setHint(kParamRadiusHint);
+        param->setRange(0., 100.);
+        param->setDisplayRange(1., 10.);
+        param->setDefault(3.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamDilation);
+        param->setLabels(kParamDilationLabel, kParamDilationLabel, kParamDilationLabel);
+        param->setHint(kParamDilationHint);
+        param->setRange(0, 100);
+        param->setDisplayRange(0, 5);
+        param->setDefault(1);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamNoise);
+        param->setLabels(kParamNoiseLabel, kParamNoiseLabel, kParamNoiseLabel);
+        param->setHint(kParamNoiseHint);
+        param->setRange(0., 1.);
+        param->setDisplayRange(0., 1.);
+        param->setDefault(0.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+} // describeInContext
+
+OFX::ImageEffect*
+InpaintPluginFactory::createInstance(OfxImageEffectHandle handle,
+                                     OFX::ContextEnum /*context*/)
+{
+    return new InpaintPlugin(handle);
+}
+
+static InpaintPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+mRegisterPluginFactoryInstance(p)
+
+OFXS_NAMESPACE_ANONYMOUS_EXIT;
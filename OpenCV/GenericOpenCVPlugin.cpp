@@ -36,6 +36,12 @@
 #include "GenericOpenCVPlugin.h"
 #include "ofxsPixelProcessor.h"
 #include "ofxsLut.h"
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <sstream>
+
 #ifdef OFX_USE_MULTITHREAD_MUTEX
 namespace {
 typedef OFX::MultiThread::Mutex Mutex;
@@ -53,30 +59,189 @@ typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
 
 using namespace OFX;
 
+// buffers smaller than this all use the same size class
+#define kCVImageBufferMinBytes 4096
+// maximum amount of memory kept in the buffer pool of each instance
+#define kCVImageBufferPoolMaxBytes (256 * 1024 * 1024)
+
+// the range of luminances encoded by eCVWorkingSpaceLog
+#define kWorkingSpaceLogMinStop -12.
+#define kWorkingSpaceLogStops 16.
+
 static OFX::Color::LutManager<Mutex>* gLutManager;
 
+struct CVImageBufferPool::Implementation
+{
+    Implementation(OFX::ImageEffect* instance,
+                   std::size_t maxIdleBytes)
+        : instance(instance)
+          , mutex()
+          , idle()
+          , idleBytes(0)
+          , maxIdleBytes(maxIdleBytes)
+          , hits(0)
+          , misses(0)
+    {
+    }
+
+    // must be called with mutex locked
+    void evict(std::size_t maxBytes)
+    {
+        // the least recently released buffers are at the back
+        while (idleBytes > maxBytes) {
+            idleBytes -= idle.back().bytes;
+            delete idle.back().memory;
+            idle.pop_back();
+        }
+    }
+
+    OFX::ImageEffect* instance;
+    Mutex mutex;
+    std::list<CVImageBuffer> idle;
+    std::size_t idleBytes;
+    std::size_t maxIdleBytes;
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+/**
+ * @brief The size class of a request: sizes are rounded up to a multiple of a power of two between 1/8 and 1/4 of
+ * the size, so that at most 25% of a buffer is wasted, while slightly different sizes (e.g. tiles on the image borders)
+ * share buffers.
+ **/
+static std::size_t
+bufferSizeClass(std::size_t bytes)
+{
+    if (bytes <= kCVImageBufferMinBytes) {
+        return kCVImageBufferMinBytes;
+    }
+    std::size_t step = 1;
+    while ( (bytes >> 3) >= step ) {
+        step <<= 1;
+    }
+
+    return (bytes + step - 1) & ~(step - 1);
+}
+
+CVImageBufferPool::CVImageBufferPool(OFX::ImageEffect* instance,
+                                     std::size_t maxIdleBytes)
+    : _imp( new Implementation(instance, maxIdleBytes) )
+{
+}
+
+CVImageBufferPool::~CVImageBufferPool()
+{
+    clear();
+    delete _imp;
+}
+
+CVImageBuffer
+CVImageBufferPool::acquire(std::size_t bytes)
+{
+    const std::size_t sizeClass = bufferSizeClass(bytes);
+    {
+        AutoMutex l(_imp->mutex);
+        for (std::list<CVImageBuffer>::iterator it = _imp->idle.begin(); it != _imp->idle.end(); ++it) {
+            if (it->bytes == sizeClass) {
+                CVImageBuffer buffer = *it;
+                _imp->idle.erase(it);
+                _imp->idleBytes -= sizeClass;
+                ++_imp->hits;
+
+                return buffer;
+            }
+        }
+        ++_imp->misses;
+    }
+
+    CVImageBuffer buffer;
+    buffer.memory = new ImageMemory(sizeClass + kCVImageBufferAlignment - 1, _imp->instance);
+    std::size_t address = (std::size_t)buffer.memory->lock();
+    buffer.data = (void*)( (address + kCVImageBufferAlignment - 1) & ~(std::size_t)(kCVImageBufferAlignment - 1) );
+    buffer.bytes = sizeClass;
+
+    return buffer;
+}
+
+void
+CVImageBufferPool::release(const CVImageBuffer & buffer)
+{
+    if (buffer.bytes > _imp->maxIdleBytes) {
+        delete buffer.memory;
+
+        return;
+    }
+    AutoMutex l(_imp->mutex);
+    _imp->idle.push_front(buffer);
+    _imp->idleBytes += buffer.bytes;
+    _imp->evict(_imp->maxIdleBytes);
+}
+
+void
+CVImageBufferPool::clear()
+{
+    AutoMutex l(_imp->mutex);
+
+    _imp->evict(0);
+}
+
+unsigned long long
+CVImageBufferPool::getHits() const
+{
+    AutoMutex l(_imp->mutex);
+
+    return _imp->hits;
+}
+
+unsigned long long
+CVImageBufferPool::getMisses() const
+{
+    AutoMutex l(_imp->mutex);
+
+    return _imp->misses;
+}
+
 CVImageWrapper::CVImageWrapper():
 #if CV_MAJOR_VERSION < 3
 _cvImgHeader(0),
 #else
 _cvMat(0),
 #endif
-_mem(0)
+_pool(0)
 {
+    _buffer.memory = 0;
+    _buffer.data = 0;
+    _buffer.bytes = 0;
 }
 
 void
-CVImageWrapper::initialize(OFX::ImageEffect* instance,
-                           const OfxRectI & bounds,
-                           OFX::PixelComponentEnum pixelComponents,
-                           int pixelComponentCount,
-                           unsigned int rowBytes,
-                           OFX::BitDepthEnum bitDepth)
+CVImageWrapper::reset()
+{
+#if CV_MAJOR_VERSION < 3
+    if (_cvImgHeader) {
+        cvReleaseImageHeader(&_cvImgHeader);
+    }
+#else
+    delete _cvMat;
+    _cvMat = 0;
+#endif
+    if (_buffer.memory) {
+        _pool->release(_buffer);
+        _buffer.memory = 0;
+        _buffer.data = 0;
+        _buffer.bytes = 0;
+    }
+}
+
+void
+CVImageWrapper::createHeader(const OfxRectI & bounds,
+                             int pixelComponentCount,
+                             unsigned int rowBytes,
+                             OFX::BitDepthEnum bitDepth,
+                             void* data)
 {
     int depth;
-    std::size_t bytes;
 #if CV_MAJOR_VERSION < 3
-    (void)rowBytes;
     switch (bitDepth) {
     case eBitDepthUByte:
         depth = IPL_DEPTH_8U;
@@ -97,7 +262,12 @@ CVImageWrapper::initialize(OFX::ImageEffect* instance,
     _cvImgHeader = cvCreateImageHeader(imageSize,
                                        depth,
                                        pixelComponentCount);
-    bytes = _cvImgHeader->imageSize;
+    // 0 means the default IplImage row alignment
+    if (rowBytes != 0) {
+        _cvImgHeader->widthStep = rowBytes;
+        _cvImgHeader->imageSize = rowBytes * imageSize.height;
+    }
+    _cvImgHeader->imageData = (char*)data;
 
 #else
     
@@ -133,24 +303,67 @@ CVImageWrapper::initialize(OFX::ImageEffect* instance,
             assert(false);
             break;
     }
-    bytes = rowBytes * (bounds.y2 - bounds.y1);
+    _cvMat = new cv::Mat(bounds.y2 - bounds.y1, bounds.x2 - bounds.x1, depth, data, rowBytes);
 #endif
+}
 
-    _mem.reset( new ImageMemory(bytes,instance) );
+void
+CVImageWrapper::initialize(CVImageBufferPool* pool,
+                           const OfxRectI & bounds,
+                           OFX::PixelComponentEnum /*pixelComponents*/,
+                           int pixelComponentCount,
+                           OFX::BitDepthEnum bitDepth)
+{
+    reset();
 
-#if CV_MAJOR_VERSION < 3
-    _cvImgHeader->imageData = (char*) _mem->lock();
-#else
-    _cvMat = new cv::Mat(bounds.y2 - bounds.y1, bounds.x2 - bounds.x1, depth, _mem->lock(),rowBytes);
-#endif
+    int componentBytes;
+    switch (bitDepth) {
+    case eBitDepthUByte:
+        componentBytes = 1;
+        break;
+    case eBitDepthUShort:
+        componentBytes = 2;
+        break;
+    case eBitDepthFloat:
+        componentBytes = 4;
+        break;
+    default:
+        throwSuiteStatusException(kOfxStatErrImageFormat);
+
+        return;
+    }
+    // tight rows, padded so that each row starts on a cache line
+    const unsigned int rowBytes = ( (bounds.x2 - bounds.x1) * pixelComponentCount * componentBytes + kCVImageBufferAlignment - 1 ) &
+                                  ~(unsigned int)(kCVImageBufferAlignment - 1);
+
+    _pool = pool;
+    _buffer = pool->acquire( (std::size_t)rowBytes * (bounds.y2 - bounds.y1) );
+    createHeader(bounds, pixelComponentCount, rowBytes, bitDepth, _buffer.data);
+}
+
+void
+CVImageWrapper::initializeView(const void* data,
+                               const OfxRectI & bounds,
+                               int pixelComponentCount,
+                               unsigned int rowBytes,
+                               OFX::BitDepthEnum bitDepth)
+{
+    reset();
+    createHeader(bounds, pixelComponentCount, rowBytes, bitDepth, const_cast<void*>(data));
 }
 
 CVImageWrapper::~CVImageWrapper()
+{
+    reset();
+}
+
+int
+CVImageWrapper::getRowBytes() const
 {
 #if CV_MAJOR_VERSION < 3
-    cvReleaseImageHeader(&_cvImgHeader);
+    return _cvImgHeader->widthStep;
 #else
-    delete _cvMat;
+    return (int)_cvMat->step[0];
 #endif
 }
 
@@ -164,16 +377,68 @@ CVImageWrapper::getData() const
 #endif
 }
 
+/**
+ * @brief Copy the window of 8-bit pixels from src to dst, which are both already encoded, so that only the components
+ * are rearranged. The components that src does not have are 0, except alpha which is opaque.
+ **/
+static void
+copyBytePacked(const void* srcPixelData,
+               const OfxRectI & srcBounds,
+               int srcPixelComponentCount,
+               int srcRowBytes,
+               const OfxRectI & window,
+               void* dstPixelData,
+               const OfxRectI & dstBounds,
+               int dstPixelComponentCount,
+               int dstRowBytes)
+{
+    assert(srcBounds.x1 <= window.x1 && window.x2 <= srcBounds.x2 && srcBounds.y1 <= window.y1 && window.y2 <= srcBounds.y2);
+    assert(dstBounds.x1 <= window.x1 && window.x2 <= dstBounds.x2 && dstBounds.y1 <= window.y1 && window.y2 <= dstBounds.y2);
+    const int width = window.x2 - window.x1;
+    const int common = std::min(srcPixelComponentCount, dstPixelComponentCount);
+    for (int y = window.y1; y < window.y2; ++y) {
+        const unsigned char* src = ( (const unsigned char*)srcPixelData + (std::ptrdiff_t)(y - srcBounds.y1) * srcRowBytes +
+                                     (window.x1 - srcBounds.x1) * srcPixelComponentCount );
+        unsigned char* dst = ( (unsigned char*)dstPixelData + (std::ptrdiff_t)(y - dstBounds.y1) * dstRowBytes +
+                               (window.x1 - dstBounds.x1) * dstPixelComponentCount );
+        if (srcPixelComponentCount == dstPixelComponentCount) {
+            std::copy(src, src + width * srcPixelComponentCount, dst);
+            continue;
+        }
+        for (int x = 0; x < width; ++x, src += srcPixelComponentCount, dst += dstPixelComponentCount) {
+            for (int c = 0; c < common; ++c) {
+                dst[c] = src[c];
+            }
+            for (int c = common; c < dstPixelComponentCount; ++c) {
+                dst[c] = (c == 3) ? 255 : 0;
+            }
+        }
+    }
+}
+
 GenericOpenCVPlugin::GenericOpenCVPlugin(OfxImageEffectHandle handle, const OFX::Color::Lut* lut_8bit)
     : ImageEffect(handle)
       , _dstClip(0)
       , _srcClip(0)
       , _srgbLut(lut_8bit)
+      , _srgbConverter( new SRGBConverter(lut_8bit) )
+      , _bufferPool(this, kCVImageBufferPoolMaxBytes)
 {
     _dstClip = fetchClip(kOfxImageEffectOutputClipName);
     _srcClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
 }
 
+void
+GenericOpenCVPlugin::purgeCaches()
+{
+    std::ostringstream msg;
+
+    msg << "image buffer pool: " << (unsigned long)_bufferPool.getHits() << " buffers reused, "
+        << (unsigned long)_bufferPool.getMisses() << " allocated";
+    sendMessage( OFX::Message::eMessageLog, "", msg.str() );
+    _bufferPool.clear();
+}
+
 void
 GenericOpenCVPlugin::fetchCVImage8U(const OFX::Image* img,
                                     const OfxRectI & renderWindow,
@@ -200,23 +465,30 @@ GenericOpenCVPlugin::fetchCVImage8U(const OFX::Image* img,
     //Force 8bit for OpenCV images
     const OFX::BitDepthEnum dstBitDepth = eBitDepthUByte;
 
-    dstImg->initialize(this, dstBounds, dstPixelComponents, dstPixelComponentCount, rowBytes, dstBitDepth);
+    // 8-bit pixels are already encoded: with the same components, the source pixels are wrapped without a copy
+    if ( copyData && (bitDepth == dstBitDepth) && (pixelComponentCount == dstPixelComponentCount) && (rowBytes > 0) &&
+         (bounds.x1 <= renderWindow.x1) && (renderWindow.x2 <= bounds.x2) &&
+         (bounds.y1 <= renderWindow.y1) && (renderWindow.y2 <= bounds.y2) ) {
+        const unsigned char* windowData = ( (const unsigned char*)pixelData + (std::size_t)(renderWindow.y1 - bounds.y1) * rowBytes +
+                                            (renderWindow.x1 - bounds.x1) * pixelComponentCount );
+        dstImg->initializeView(windowData, dstBounds, dstPixelComponentCount, rowBytes, dstBitDepth);
+
+        return;
+    }
+
+    dstImg->initialize(&_bufferPool, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth);
     unsigned char* dstPixelData = dstImg->getData();
-    
-#if CV_MAJOR_VERSION < 3
-    int dstRowBytes = dstImg->getIplImage()->widthStep;
-#else
-    int dstRowBytes = rowBytes;
-#endif
-    
-    if (copyData) {
-        OfxRectI convertWindow;
-        convertWindow.x1 = convertWindow.y1 = 0;
-        convertWindow.x2 = renderWindow.x2 - renderWindow.x1;
-        convertWindow.y2 = renderWindow.y2 - renderWindow.y1;
-        _srgbLut->to_byte_packed_nodither(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
-                                          renderWindow,
-                                          dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    int dstRowBytes = dstImg->getRowBytes();
+    assert( dstRowBytes >= (dstBounds.x2 - dstBounds.x1) * dstPixelComponentCount );
+
+    if (copyData && bitDepth == eBitDepthUByte) {
+        copyBytePacked(pixelData, bounds, pixelComponentCount, rowBytes,
+                       renderWindow,
+                       dstPixelData, dstBounds, dstPixelComponentCount, dstRowBytes);
+    } else if (copyData) {
+        _srgbConverter->to_byte_packed_nodither(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
+                                                renderWindow,
+                                                dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     }
 }
 
@@ -242,28 +514,70 @@ GenericOpenCVPlugin::fetchCVImage8UGrayscale(const OFX::Image* img,
     //Force 8bit for OpenCV images
     const OFX::BitDepthEnum dstBitDepth = eBitDepthUByte;
 
-    int expectedRowBytes = rowBytes / pixelComponentCount;
-    
-    cvImg->initialize(this, dstBounds, dstPixelComponents, dstPixelComponentCount, expectedRowBytes, dstBitDepth);
+    cvImg->initialize(&_bufferPool, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth);
     unsigned char* dstPixelData = cvImg->getData();
-    
-#if CV_MAJOR_VERSION < 3
-    int dstRowBytes = cvImg->getIplImage()->widthStep;
-#else
-    int dstRowBytes = expectedRowBytes;
-#endif
+    int dstRowBytes = cvImg->getRowBytes();
+    assert( dstRowBytes >= (dstBounds.x2 - dstBounds.x1) * dstPixelComponentCount );
 
     if (copyData) {
         OfxRectI convertWindow;
         convertWindow.x1 = convertWindow.y1 = 0;
         convertWindow.x2 = renderWindow.x2 - renderWindow.x1;
         convertWindow.y2 = renderWindow.y2 - renderWindow.y1;
-        _srgbLut->to_byte_grayscale_nodither(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
-                                             renderWindow,
-                                             dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+        _srgbConverter->to_byte_grayscale_nodither(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
+                                                   renderWindow,
+                                                   dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
     }
 }
 
+void
+GenericOpenCVPlugin::fetchCVImage32FGrayscale(const OFX::Image* img,
+                                              const OfxRectI & renderWindow,
+                                              CVWorkingSpaceEnum workingSpace,
+                                              CVImageWrapper* cvImg)
+{
+    const void* pixelData = NULL;
+    OfxRectI bounds;
+    OFX::PixelComponentEnum pixelComponents;
+    OFX::BitDepthEnum bitDepth;
+    int rowBytes;
+
+    getImageData(img, &pixelData, &bounds, &pixelComponents, &bitDepth, &rowBytes);
+    int pixelComponentCount = img->getPixelComponentCount();
+    if (bitDepth != eBitDepthFloat) {
+        throwSuiteStatusException(kOfxStatErrImageFormat);
+    }
+    assert(pixelComponents == ePixelComponentRGBA || pixelComponents == ePixelComponentRGB || pixelComponents == ePixelComponentAlpha);
+    assert(bounds.x1 <= renderWindow.x1 && renderWindow.x2 <= bounds.x2 && bounds.y1 <= renderWindow.y1 && renderWindow.y2 <= bounds.y2);
+
+    const int width = renderWindow.x2 - renderWindow.x1;
+    cvImg->initialize(&_bufferPool, renderWindow, ePixelComponentAlpha, 1, eBitDepthFloat);
+    char* dstPixelData = (char*)cvImg->getData();
+    int dstRowBytes = cvImg->getRowBytes();
+    assert( dstRowBytes >= width * (int)sizeof(float) );
+
+    const double logScale = 1. / (std::log(2.) * kWorkingSpaceLogStops);
+    const double logOffset = -kWorkingSpaceLogMinStop / kWorkingSpaceLogStops;
+    const float logMin = (float)std::pow(2., kWorkingSpaceLogMinStop);
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        const float* src = (const float*)( (const char*)pixelData + (std::ptrdiff_t)(y - bounds.y1) * rowBytes ) + (renderWindow.x1 - bounds.x1) * pixelComponentCount;
+        float* dst = (float*)( dstPixelData + (std::ptrdiff_t)(y - renderWindow.y1) * dstRowBytes );
+        if (pixelComponentCount == 1) {
+            std::copy(src, src + width, dst);
+        } else {
+            // the luminance of the 8-bit grayscale conversion
+            _srgbConverter->to_luminance(src, pixelComponentCount, width, dst);
+        }
+        if (workingSpace == eCVWorkingSpaceLog) {
+            for (int x = 0; x < width; ++x) {
+                // NaNs also go to the bottom of the range
+                float l = (dst[x] > logMin) ? dst[x] : logMin;
+                dst[x] = (float)(std::log( (double)l ) * logScale + logOffset);
+            }
+        }
+    }
+} // GenericOpenCVPlugin::fetchCVImage32FGrayscale
+
 void
 GenericOpenCVPlugin::cvImageToOfxImage(const CVImageWrapper & cvImg,
                                        const OfxRectI & renderWindow,
@@ -319,9 +633,17 @@ GenericOpenCVPlugin::cvImageToOfxImage(const CVImageWrapper & cvImg,
     getImageData(dstImg, &dstPixelData, &dstBounds, &dstPixelComponents, &dstBitDepth, &dstRowBytes);
     int dstPixelComponentCount = dstImg->getPixelComponentCount();
 
-    _srgbLut->from_byte_packed(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
-                               renderWindow,
-                               dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+    if (dstBitDepth == eBitDepthUByte) {
+        // the 8-bit result is already encoded
+        copyBytePacked(pixelData, bounds, pixelComponentCount, rowBytes,
+                       renderWindow,
+                       dstPixelData, dstBounds, dstPixelComponentCount, dstRowBytes);
+
+        return;
+    }
+    _srgbConverter->from_byte_packed(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
+                                     renderWindow,
+                                     dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
 }
 
 void
@@ -357,3 +679,55 @@ genericCVDescribe(const std::string & pluginName,
     desc.setRenderThreadSafety(threadSafety);
 }
 
+static bool
+rectIsLeftOf(const cv::Rect & a,
+             const cv::Rect & b)
+{
+    return a.x < b.x;
+}
+
+void
+maskRegions(const cv::Mat & mask,
+            int margin,
+            std::vector<cv::Rect>* regions)
+{
+    // growing the mask by margin joins the regions closer than that, and gives their grown boxes, already clipped
+    cv::Mat contourMask;
+    if (margin > 0) {
+        cv::dilate( mask, contourMask, cv::getStructuringElement( cv::MORPH_RECT, cv::Size(2 * margin + 1, 2 * margin + 1) ) );
+    } else {
+        // findContours modifies its input
+        contourMask = mask.clone();
+    }
+    std::vector<std::vector<cv::Point> > contours;
+
+    cv::findContours(contourMask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+
+    std::vector<cv::Rect> boxes( contours.size() );
+    for (std::size_t i = 0; i < contours.size(); ++i) {
+        boxes[i] = cv::boundingRect(contours[i]);
+    }
+
+    // the boxes of separate regions may still overlap: merge them in a single sweep from left to right, keeping the
+    // merged boxes pairwise disjoint. A box grows into each kept box at most once.
+    std::sort(boxes.begin(), boxes.end(), rectIsLeftOf);
+    const std::size_t first = regions->size();
+    for (std::size_t i = 0; i < boxes.size(); ++i) {
+        cv::Rect r = boxes[i];
+        bool grown = true;
+        while (grown) {
+            grown = false;
+            for (std::size_t j = first; j < regions->size(); ) {
+                if ( ( r & (*regions)[j] ).area() > 0 ) {
+                    r |= (*regions)[j];
+                    (*regions)[j] = regions->back();
+                    regions->pop_back();
+                    grown = true;
+                } else {
+                    ++j;
+                }
+            }
+        }
+        regions->push_back(r);
+    }
+}
@@ -42,6 +42,11 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <cstddef>
+#include <vector>
+
+#include "SRGBConverter.h"
+
 namespace OFX {
 namespace Color {
 class Lut;
@@ -49,7 +54,54 @@ class Lut;
 }
 
 
-//8bit sRGB images
+// the encoding of the float images computed by GenericOpenCVPlugin::fetchCVImage32FGrayscale
+enum CVWorkingSpaceEnum
+{
+    eCVWorkingSpaceLinear = 0, // linear luminance
+    eCVWorkingSpaceLog // log2 of the luminance, from 2^-12 (0) to 2^4 (1)
+};
+
+// alignment of the pixel buffers and of the rows of CVImageWrapper, a cache line
+#define kCVImageBufferAlignment 64
+
+// a pixel buffer of a CVImageBufferPool
+struct CVImageBuffer
+{
+    OFX::ImageMemory* memory;
+    void* data; // aligned on kCVImageBufferAlignment
+    std::size_t bytes; // usable bytes from data
+};
+
+/**
+ * @brief A thread-safe pool of the pixel buffers of CVImageWrapper, owned by a plugin instance.
+ * Released buffers are kept, up to a total of maxIdleBytes, and are handed out again to requests of the same size class,
+ * so that successive renders do not allocate and fault in new memory for each image.
+ **/
+class CVImageBufferPool
+{
+public:
+    CVImageBufferPool(OFX::ImageEffect* instance, std::size_t maxIdleBytes);
+
+    ~CVImageBufferPool();
+
+    // get a buffer of at least bytes, which must be given back with release()
+    CVImageBuffer acquire(std::size_t bytes);
+
+    void release(const CVImageBuffer & buffer);
+
+    // free all the idle buffers
+    void clear();
+
+    // number of requests served by an idle buffer, and by a new allocation
+    unsigned long long getHits() const;
+    unsigned long long getMisses() const;
+
+private:
+    struct Implementation;
+    Implementation* _imp;
+};
+
+//8bit sRGB images, or 32-bit float images
 class CVImageWrapper
 {
 public:
@@ -58,14 +110,31 @@ public:
 
     ~CVImageWrapper();
 
-    void initialize(OFX::ImageEffect* instance,
+    /**
+     * @brief Allocate the pixels, from pool which must outlive the wrapper. The rows are tight, padded to a multiple
+     * of kCVImageBufferAlignment bytes, whatever the layout of the image the pixels are converted from.
+     **/
+    void initialize(CVImageBufferPool* pool,
                     const OfxRectI & bounds,
                     OFX::PixelComponentEnum pixelComponents,
                     int pixelComponentCount,
-                    unsigned int rowBytes,
                     OFX::BitDepthEnum bitDepth);
 
+    /**
+     * @brief Wrap existing pixels without copying them. The wrapper does not own the pixels, which must outlive it,
+     * and they must not be written to through the wrapper if they belong to a source image.
+     * @param data The address of the pixel at (bounds.x1, bounds.y1).
+     **/
+    void initializeView(const void* data,
+                        const OfxRectI & bounds,
+                        int pixelComponentCount,
+                        unsigned int rowBytes,
+                        OFX::BitDepthEnum bitDepth);
+
     unsigned char* getData() const;
+
+    // the number of bytes between two rows
+    int getRowBytes() const;
     
 #if CV_MAJOR_VERSION < 3
     IplImage* getIplImage() const
@@ -82,12 +151,22 @@ public:
 
 private:
 
+    // release the header and the buffer
+    void reset();
+
+    void createHeader(const OfxRectI & bounds,
+                      int pixelComponentCount,
+                      unsigned int rowBytes,
+                      OFX::BitDepthEnum bitDepth,
+                      void* data);
+
 #if CV_MAJOR_VERSION < 3
     IplImage* _cvImgHeader;
 #else
     cv::Mat* _cvMat;
 #endif
-    std::auto_ptr<OFX::ImageMemory> _mem;
+    CVImageBufferPool* _pool;
+    CVImageBuffer _buffer;
 };
 
 class GenericOpenCVPlugin
@@ -97,6 +176,12 @@ public:
     /** @brief ctor */
     GenericOpenCVPlugin(OfxImageEffectHandle handle, const OFX::Color::Lut* lut_8bit);
 
+    /**
+     * Override the purge caches action, which logs the hits and misses of the image buffer pool and frees its idle
+     * buffers. Subclasses must call it.
+     */
+    virtual void purgeCaches() OVERRIDE;
+
 private:
     // override the roi call
     //virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
@@ -110,16 +195,30 @@ private:
 
 protected:
 
+    /**
+     * @brief Convert the renderWindow of img to 8-bit sRGB. If copyData is true and img is already 8-bit with the requested
+     * components, dstImg is a read-only view of the pixels of img, which must then outlive it.
+     **/
     void fetchCVImage8U(const OFX::Image* img, const OfxRectI & renderWindow, bool copyData, CVImageWrapper* dstImg, OFX::PixelComponentEnum dstPixelComponents = OFX::ePixelComponentNone, int dstPixelComponentCount = 0);
 
     void fetchCVImage8UGrayscale(const OFX::Image* img, const OfxRectI & renderWindow, bool copyData, CVImageWrapper* dstImg);
 
+    /**
+     * @brief Compute the luminance of the renderWindow of the float image img as a single channel float image,
+     * encoded in the given working space. Unlike fetchCVImage8UGrayscale, the pixels are neither converted to sRGB
+     * nor quantized.
+     **/
+    void fetchCVImage32FGrayscale(const OFX::Image* img, const OfxRectI & renderWindow, CVWorkingSpaceEnum workingSpace, CVImageWrapper* dstImg);
+
     void cvImageToOfxImage(const CVImageWrapper & cvImg, const OfxRectI & renderWindow, OFX::Image* img);
 
     // do not need to delete these, the ImageEffect is managing them for us
     OFX::Clip *_dstClip;
     OFX::Clip *_srcClip;
     const OFX::Color::Lut* _srgbLut;
+    // the 8-bit conversions of _srgbLut, vectorized
+    std::auto_ptr<SRGBConverter> _srgbConverter;
+    CVImageBufferPool _bufferPool;
 };
 
 void genericCVDescribe(const std::string & pluginName,
@@ -131,5 +230,10 @@ void genericCVDescribe(const std::string & pluginName,
                        OFX::RenderSafetyEnum threadSafety,
                        OFX::ImageEffectDescriptor & desc);
 
+/**
+ * @brief The bounding boxes of the connected regions of the non-zero pixels of the 8-bit mask, grown by margin and
+ * clipped to the mask. Boxes that overlap are merged, so that each box can be processed independently.
+ **/
+void maskRegions(const cv::Mat & mask, int margin, std::vector<cv::Rect>* regions);
 
 #endif /* defined(__GenericOpenCVPlugin_h__) */
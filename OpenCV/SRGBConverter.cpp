@@ -0,0 +1,779 @@
+/*
+   OFX sRGB conversion engine for the OpenCV plugins.
+
+   Copyright (C) 2014 INRIA
+
+   Redistribution and use in source and binary forms, with or without modification,
+   are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+   Redistributions in binary form must reproduce the above copyright notice, this
+   list of conditions and the following disclaimer in the documentation and/or
+   other materials provided with the distribution.
+
+   Neither the name of the {organization} nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   INRIA
+   Domaine de Voluceau
+   Rocquencourt - B.P. 105
+   78153 Le Chesnay Cedex - France
+ */
+#include "SRGBConverter.h"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+
+#include "ofxsLut.h"
+#include "ofxsMultiThread.h"
+
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SRGB_CONVERTER_X86
+#define SRGB_CONVERTER_TARGET(t) __attribute__( ( target(t) ) )
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define SRGB_CONVERTER_X86
+#define SRGB_CONVERTER_TARGET(t)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+using namespace OFX;
+
+#define kToByteBucketCount 0x8000 // one bucket per 16 high bits of a non-negative float, up to NaN
+#define kToByteNoThreshold 0x10000
+#define kFromByteTableSize 256
+#define kLumaProbeCount 4096
+
+static inline int
+floatBits(float v)
+{
+    int bits;
+
+    std::memcpy( &bits, &v, sizeof(bits) );
+
+    return bits;
+}
+
+static inline float
+bitsFloat(int bits)
+{
+    float v;
+
+    std::memcpy( &v, &bits, sizeof(v) );
+
+    return v;
+}
+
+static inline unsigned char
+toByteScalar(const int* table,
+             unsigned char nanValue,
+             float v)
+{
+    if (v != v) {
+        return nanValue;
+    }
+    int bits = floatBits(v);
+    if (bits < 0) {
+        bits = 0; // negative values convert as 0
+    }
+    int entry = table[bits >> 16];
+
+    return (unsigned char)( (entry >> 17) + ( (bits & 0xffff) >= (entry & 0x1ffff) ) );
+}
+
+// Convert n consecutive floats of interleaved pixels with nComponents components. Only with 4 components the last
+// component is alpha.
+static void
+toByteRowScalar(const float* src,
+                unsigned char* dst,
+                int n,
+                int nComponents,
+                const int* table,
+                const unsigned char* nanValues)
+{
+    if (nComponents == 4) {
+        const int* alphaTable = table + kToByteBucketCount;
+        for (int i = 0; i < n; i += 4) {
+            dst[i] = toByteScalar(table, nanValues[0], src[i]);
+            dst[i + 1] = toByteScalar(table, nanValues[0], src[i + 1]);
+            dst[i + 2] = toByteScalar(table, nanValues[0], src[i + 2]);
+            dst[i + 3] = toByteScalar(alphaTable, nanValues[1], src[i + 3]);
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            dst[i] = toByteScalar(table, nanValues[0], src[i]);
+        }
+    }
+}
+
+static void
+fromByteRowScalar(const unsigned char* src,
+                  float* dst,
+                  int n,
+                  int nComponents,
+                  const float* table)
+{
+    if (nComponents == 4) {
+        const float* alphaTable = table + kFromByteTableSize;
+        for (int i = 0; i < n; i += 4) {
+            dst[i] = table[src[i]];
+            dst[i + 1] = table[src[i + 1]];
+            dst[i + 2] = table[src[i + 2]];
+            dst[i + 3] = alphaTable[src[i + 3]];
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            dst[i] = table[src[i]];
+        }
+    }
+}
+
+#ifdef SRGB_CONVERTER_X86
+
+static bool
+cpuHasSSE41()
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("sse4.1");
+#else
+    int info[4];
+    __cpuid(info, 1);
+
+    return (info[2] & (1 << 19) ) != 0;
+#endif
+}
+
+static bool
+cpuHasAVX2()
+{
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("avx2");
+#else
+    int info[4];
+    __cpuid(info, 1);
+    // the OS must save the AVX registers
+    if ( ( (info[2] & (1 << 27) ) == 0 ) || ( (info[2] & (1 << 28) ) == 0 ) || ( (_xgetbv(0) & 6) != 6 ) ) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+
+    return (info[1] & (1 << 5) ) != 0;
+#endif
+}
+
+SRGB_CONVERTER_TARGET("sse4.1")
+static void
+toByteRowSSE41(const float* src,
+               unsigned char* dst,
+               int n,
+               int nComponents,
+               const int* table,
+               const unsigned char* nanValues)
+{
+    // with 4 components, each vector is one pixel and its last lane is alpha
+    const int alphaOffset = (nComponents == 4) ? kToByteBucketCount : 0;
+    const __m128i laneOffset = _mm_set_epi32(alphaOffset, 0, 0, 0);
+    const __m128i nanValue = _mm_set_epi32( (nComponents == 4) ? nanValues[1] : nanValues[0], nanValues[0], nanValues[0], nanValues[0] );
+    const __m128i lowMask = _mm_set1_epi32(0xffff);
+    const __m128i thresholdMask = _mm_set1_epi32(0x1ffff);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(src + i);
+        __m128i isNaN = _mm_castps_si128( _mm_cmpunord_ps(v, v) );
+        __m128i bits = _mm_max_epi32(_mm_castps_si128(v), zero);
+        __m128i index = _mm_add_epi32(_mm_srli_epi32(bits, 16), laneOffset);
+        // no gather before AVX2
+        __m128i entry = _mm_set_epi32( table[_mm_extract_epi32(index, 3)], table[_mm_extract_epi32(index, 2)],
+                                       table[_mm_extract_epi32(index, 1)], table[_mm_extract_epi32(index, 0)] );
+        __m128i below = _mm_cmpgt_epi32( _mm_and_si128(entry, thresholdMask), _mm_and_si128(bits, lowMask) );
+        __m128i value = _mm_add_epi32( _mm_add_epi32(_mm_srli_epi32(entry, 17), one), below );
+        value = _mm_blendv_epi8(value, nanValue, isNaN);
+        value = _mm_packus_epi16(_mm_packus_epi32(value, value), zero);
+        int packed = _mm_cvtsi128_si32(value);
+        std::memcpy(dst + i, &packed, 4);
+    }
+    if (i < n) {
+        toByteRowScalar(src + i, dst + i, n - i, nComponents, table, nanValues);
+    }
+}
+
+SRGB_CONVERTER_TARGET("avx2")
+static void
+toByteRowAVX2(const float* src,
+              unsigned char* dst,
+              int n,
+              int nComponents,
+              const int* table,
+              const unsigned char* nanValues)
+{
+    // with 4 components, each vector holds two pixels
+    const int alphaOffset = (nComponents == 4) ? kToByteBucketCount : 0;
+    const int alphaNaN = (nComponents == 4) ? nanValues[1] : nanValues[0];
+    const int colorNaN = nanValues[0];
+    const __m256i laneOffset = _mm256_set_epi32(alphaOffset, 0, 0, 0, alphaOffset, 0, 0, 0);
+    const __m256i nanValue = _mm256_set_epi32(alphaNaN, colorNaN, colorNaN, colorNaN, alphaNaN, colorNaN, colorNaN, colorNaN);
+    const __m256i lowMask = _mm256_set1_epi32(0xffff);
+    const __m256i thresholdMask = _mm256_set1_epi32(0x1ffff);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+    // the low byte of each 32-bit lane, gathered in the low 32 bits of each 128-bit half
+    const __m256i byteShuffle = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                 0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i halfPermute = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(src + i);
+        __m256i isNaN = _mm256_castps_si256( _mm256_cmp_ps(v, v, _CMP_UNORD_Q) );
+        __m256i bits = _mm256_max_epi32(_mm256_castps_si256(v), zero);
+        __m256i index = _mm256_add_epi32(_mm256_srli_epi32(bits, 16), laneOffset);
+        __m256i entry = _mm256_i32gather_epi32(table, index, 4);
+        __m256i below = _mm256_cmpgt_epi32( _mm256_and_si256(entry, thresholdMask), _mm256_and_si256(bits, lowMask) );
+        __m256i value = _mm256_add_epi32( _mm256_add_epi32(_mm256_srli_epi32(entry, 17), one), below );
+        value = _mm256_blendv_epi8(value, nanValue, isNaN);
+        value = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(value, byteShuffle), halfPermute);
+        _mm_storel_epi64( (__m128i*)(dst + i), _mm256_castsi256_si128(value) );
+    }
+    if (i < n) {
+        toByteRowScalar(src + i, dst + i, n - i, nComponents, table, nanValues);
+    }
+}
+
+SRGB_CONVERTER_TARGET("avx2")
+static void
+fromByteRowAVX2(const unsigned char* src,
+                float* dst,
+                int n,
+                int nComponents,
+                const float* table)
+{
+    const int alphaOffset = (nComponents == 4) ? kFromByteTableSize : 0;
+    const __m256i laneOffset = _mm256_set_epi32(alphaOffset, 0, 0, 0, alphaOffset, 0, 0, 0);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i index = _mm256_add_epi32(_mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)(src + i) ) ), laneOffset);
+        _mm256_storeu_ps( dst + i, _mm256_i32gather_ps(table, index, 4) );
+    }
+    if (i < n) {
+        fromByteRowScalar(src + i, dst + i, n - i, nComponents, table);
+    }
+}
+
+#endif // SRGB_CONVERTER_X86
+
+// the ways the Lut may compute the luminance of the grayscale conversion
+enum LumaEnum
+{
+    eLumaRec709Float = 0,
+    eLumaRec709Double,
+    eLumaRec601Float,
+    eLumaRec601Double,
+    eLumaCount
+};
+
+static inline float
+luminance(LumaEnum luma,
+          const float* p)
+{
+    switch (luma) {
+    case eLumaRec709Float:
+        return 0.2126f * p[0] + 0.7152f * p[1] + 0.0722f * p[2];
+    case eLumaRec709Double:
+        return (float)(0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2]);
+    case eLumaRec601Float:
+        return 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+    case eLumaRec601Double:
+    default:
+        return (float)(0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2]);
+    }
+}
+
+struct SRGBConverter::Tables
+{
+    explicit Tables(const OFX::Color::Lut* lut);
+
+    // float to byte: one entry per 16 high bits of a non-negative float, for the color channels then for alpha.
+    // Each entry holds (value at the start of the bucket) << 17 | (offset of the threshold in the bucket, or 0x10000)
+    std::vector<int> toByte;
+    unsigned char toByteNaN[2];
+
+    // byte to float: 256 values for the color channels then for alpha
+    std::vector<float> fromByte;
+
+    // the luminance computed by the grayscale conversion of the Lut
+    LumaEnum luma;
+};
+
+// convert one RGBA pixel with every component set to v, and return the color and alpha bytes
+static void
+probeToByte(const OFX::Color::Lut* lut,
+            float v,
+            unsigned char* color,
+            unsigned char* alpha)
+{
+    const OfxRectI bounds = {0, 0, 1, 1};
+    float src[4] = {v, v, v, v};
+    unsigned char dst[4];
+
+    lut->to_byte_packed_nodither(src, bounds, ePixelComponentRGBA, 4, eBitDepthFloat, sizeof(src),
+                                 bounds,
+                                 dst, bounds, ePixelComponentRGBA, 4, eBitDepthUByte, sizeof(dst));
+    *color = dst[0];
+    *alpha = dst[3];
+}
+
+// smallest non-negative float (as bits) that converts to at least value, or +inf+1 if there is none
+static int
+findThreshold(const OFX::Color::Lut* lut,
+              bool alpha,
+              int value)
+{
+    int lo = 0;
+    int hi = floatBits( std::numeric_limits<float>::infinity() ) + 1;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        unsigned char color, a;
+        probeToByte(lut, bitsFloat(mid), &color, &a);
+        if ( (alpha ? a : color) >= value ) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return lo;
+}
+
+SRGBConverter::Tables::Tables(const OFX::Color::Lut* lut)
+    : toByte(2 * kToByteBucketCount)
+      , fromByte(2 * kFromByteTableSize)
+      , luma(eLumaRec709Float)
+{
+    const int noThreshold = floatBits( std::numeric_limits<float>::infinity() ) + 1;
+
+    for (int t = 0; t < 2; ++t) {
+        // the byte values are counts of thresholds, so the conversion must be monotonic with at most one threshold
+        // per bucket
+        std::vector<long long> thresholds(257, 1LL << 40);
+        thresholds[0] = 0;
+        for (int value = 1; value < 256; ++value) {
+            int threshold = findThreshold(lut, t == 1, value);
+            if (threshold != noThreshold) {
+                thresholds[value] = threshold;
+            }
+        }
+        int* table = &toByte[t * kToByteBucketCount];
+        int value = 0;
+        for (int bucket = 0; bucket < kToByteBucketCount; ++bucket) {
+            const long long start = (long long)bucket << 16;
+            const long long end = start + 0x10000;
+            while ( value < 255 && thresholds[value + 1] <= start ) {
+                ++value;
+            }
+            int threshold = kToByteNoThreshold;
+            if (thresholds[value + 1] < end) {
+                threshold = (int)(thresholds[value + 1] - start);
+                if (thresholds[value + 2] < end) {
+                    throw std::runtime_error("SRGBConverter: the Lut has several byte thresholds in a bucket");
+                }
+            }
+            table[bucket] = (value << 17) | threshold;
+        }
+        unsigned char color, alpha;
+        probeToByte(lut, std::numeric_limits<float>::quiet_NaN(), &color, &alpha);
+        toByteNaN[t] = (t == 1) ? alpha : color;
+    }
+
+    {
+        const OfxRectI bounds = {0, 0, 1, 1};
+        for (int i = 0; i < kFromByteTableSize; ++i) {
+            unsigned char src[4] = {
+                (unsigned char)i, (unsigned char)i, (unsigned char)i, (unsigned char)i
+            };
+            float dst[4];
+            lut->from_byte_packed(src, bounds, ePixelComponentRGBA, 4, eBitDepthUByte, sizeof(src),
+                                  bounds,
+                                  dst, bounds, ePixelComponentRGBA, 4, eBitDepthFloat, sizeof(dst));
+            fromByte[i] = dst[0];
+            fromByte[kFromByteTableSize + i] = dst[3];
+        }
+    }
+
+    // the luminance formula is the one that gives the bytes of the Lut on pseudo-random pixels around [0,1]
+    const int width = kLumaProbeCount;
+    const OfxRectI bounds = {0, 0, width, 1};
+    std::vector<float> src(width * 3);
+    unsigned int seed = 1;
+    for (std::size_t i = 0; i < src.size(); ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        src[i] = -0.25f + 1.5f * (float)(seed >> 8) / (float)(1 << 24);
+    }
+    std::vector<unsigned char> expected(width);
+    lut->to_byte_grayscale_nodither(&src[0], bounds, ePixelComponentRGB, 3, eBitDepthFloat, width * 3 * sizeof(float),
+                                    bounds,
+                                    &expected[0], bounds, ePixelComponentAlpha, 1, eBitDepthUByte, width);
+    for (int l = 0; l < eLumaCount; ++l) {
+        int x = 0;
+        while ( x < width && toByteScalar(&toByte[0], toByteNaN[0], luminance( (LumaEnum)l, &src[x * 3] ) ) == expected[x] ) {
+            ++x;
+        }
+        if (x == width) {
+            luma = (LumaEnum)l;
+
+            return;
+        }
+    }
+    throw std::runtime_error("SRGBConverter: unknown luminance formula in the grayscale conversion of the Lut");
+}
+
+// the tables of each Lut, built once and kept while the plugins are loaded.
+// A Lut whose tables cannot be built maps to NULL, and its converters use the Lut itself.
+static Mutex gTablesMutex;
+static std::map<const OFX::Color::Lut*, const SRGBConverter::Tables*> gTables;
+
+static const SRGBConverter::Tables*
+getTables(const OFX::Color::Lut* lut)
+{
+    AutoMutex l(gTablesMutex);
+    std::map<const OFX::Color::Lut*, const SRGBConverter::Tables*>::const_iterator it = gTables.find(lut);
+
+    if ( it != gTables.end() ) {
+        return it->second;
+    }
+    const SRGBConverter::Tables* tables = NULL;
+    try {
+        tables = new SRGBConverter::Tables(lut);
+    } catch (const std::exception &) {
+        // e.g. a Lut with several byte thresholds in a bucket, or an unknown luminance formula
+        tables = NULL;
+    }
+    gTables[lut] = tables;
+
+    return tables;
+}
+
+SRGBConverter::SRGBConverter(const OFX::Color::Lut* lut)
+    : _lut(lut)
+      , _tables( getTables(lut) )
+      , _kernel(eKernelScalar)
+{
+    if (!_tables) {
+        return;
+    }
+    if ( isKernelSupported(eKernelAVX2) ) {
+        _kernel = eKernelAVX2;
+    } else if ( isKernelSupported(eKernelSSE41) ) {
+        _kernel = eKernelSSE41;
+    }
+}
+
+SRGBConverter::SRGBConverter(const OFX::Color::Lut* lut,
+                             KernelEnum kernel)
+    : _lut(lut)
+      , _tables( getTables(lut) )
+      , _kernel(_tables ? kernel : eKernelScalar)
+{
+    assert( isKernelSupported(kernel) );
+}
+
+bool
+SRGBConverter::isKernelSupported(KernelEnum kernel)
+{
+    switch (kernel) {
+    case eKernelScalar:
+        return true;
+#ifdef SRGB_CONVERTER_X86
+    case eKernelSSE41:
+        return cpuHasSSE41();
+    case eKernelAVX2:
+        return cpuHasAVX2();
+#endif
+    default:
+        return false;
+    }
+}
+
+void
+SRGBConverter::toBytePacked(const float* pixelData,
+                            const OfxRectI & bounds,
+                            int pixelComponentCount,
+                            int rowBytes,
+                            const OfxRectI & renderWindow,
+                            unsigned char* dstPixelData,
+                            const OfxRectI & dstBounds,
+                            int dstPixelComponentCount,
+                            int dstRowBytes) const
+{
+    const int width = renderWindow.x2 - renderWindow.x1;
+    const int* table = &_tables->toByte[0];
+    const unsigned char* nanValues = _tables->toByteNaN;
+
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        const float* src = (const float*)( (const char*)pixelData + (std::ptrdiff_t)(y - bounds.y1) * rowBytes ) +
+                           (renderWindow.x1 - bounds.x1) * pixelComponentCount;
+        unsigned char* dst = dstPixelData + (std::ptrdiff_t)(y - dstBounds.y1) * dstRowBytes +
+                             (renderWindow.x1 - dstBounds.x1) * dstPixelComponentCount;
+
+        if (pixelComponentCount != dstPixelComponentCount) {
+            // RGBA to RGB: alpha is dropped
+            for (int x = 0; x < width; ++x, src += pixelComponentCount, dst += dstPixelComponentCount) {
+                for (int c = 0; c < dstPixelComponentCount; ++c) {
+                    dst[c] = toByteScalar(table, nanValues[0], src[c]);
+                }
+            }
+            continue;
+        }
+        const int n = width * pixelComponentCount;
+        switch (_kernel) {
+#ifdef SRGB_CONVERTER_X86
+        case eKernelAVX2:
+            toByteRowAVX2(src, dst, n, pixelComponentCount, table, nanValues);
+            break;
+        case eKernelSSE41:
+            toByteRowSSE41(src, dst, n, pixelComponentCount, table, nanValues);
+            break;
+#endif
+        default:
+            toByteRowScalar(src, dst, n, pixelComponentCount, table, nanValues);
+            break;
+        }
+    }
+}
+
+void
+SRGBConverter::toByteGrayscale(const float* pixelData,
+                               const OfxRectI & bounds,
+                               int pixelComponentCount,
+                               int rowBytes,
+                               const OfxRectI & renderWindow,
+                               unsigned char* dstPixelData,
+                               const OfxRectI & dstBounds,
+                               int dstRowBytes) const
+{
+    const int width = renderWindow.x2 - renderWindow.x1;
+
+    if (width <= 0) {
+        return;
+    }
+    const int* table = &_tables->toByte[0];
+    const unsigned char* nanValues = _tables->toByteNaN;
+    const LumaEnum luma = _tables->luma;
+    std::vector<float> lum(width);
+
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        const float* src = (const float*)( (const char*)pixelData + (std::ptrdiff_t)(y - bounds.y1) * rowBytes ) +
+                           (renderWindow.x1 - bounds.x1) * pixelComponentCount;
+        unsigned char* dst = dstPixelData + (std::ptrdiff_t)(y - dstBounds.y1) * dstRowBytes + (renderWindow.x1 - dstBounds.x1);
+
+        // the luminance is computed exactly as the Lut does, the conversion is then the one of the color channels
+        for (int x = 0; x < width; ++x, src += pixelComponentCount) {
+            lum[x] = luminance(luma, src);
+        }
+        switch (_kernel) {
+#ifdef SRGB_CONVERTER_X86
+        case eKernelAVX2:
+            toByteRowAVX2(&lum[0], dst, width, 1, table, nanValues);
+            break;
+        case eKernelSSE41:
+            toByteRowSSE41(&lum[0], dst, width, 1, table, nanValues);
+            break;
+#endif
+        default:
+            toByteRowScalar(&lum[0], dst, width, 1, table, nanValues);
+            break;
+        }
+    }
+} // SRGBConverter::toByteGrayscale
+
+void
+SRGBConverter::fromBytePacked(const unsigned char* pixelData,
+                              const OfxRectI & bounds,
+                              int pixelComponentCount,
+                              int rowBytes,
+                              const OfxRectI & renderWindow,
+                              float* dstPixelData,
+                              const OfxRectI & dstBounds,
+                              int dstRowBytes) const
+{
+    const int n = (renderWindow.x2 - renderWindow.x1) * pixelComponentCount;
+    const float* table = &_tables->fromByte[0];
+
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        const unsigned char* src = pixelData + (std::ptrdiff_t)(y - bounds.y1) * rowBytes + (renderWindow.x1 - bounds.x1) * pixelComponentCount;
+        float* dst = (float*)( (char*)dstPixelData + (std::ptrdiff_t)(y - dstBounds.y1) * dstRowBytes ) +
+                     (renderWindow.x1 - dstBounds.x1) * pixelComponentCount;
+        switch (_kernel) {
+#ifdef SRGB_CONVERTER_X86
+        case eKernelAVX2:
+            fromByteRowAVX2(src, dst, n, pixelComponentCount, table);
+            break;
+#endif
+        default:
+            // SSE4.1 has no gather, the scalar table lookup is as fast
+            fromByteRowScalar(src, dst, n, pixelComponentCount, table);
+            break;
+        }
+    }
+}
+
+void
+SRGBConverter::to_luminance(const float* pixelData,
+                            int pixelComponentCount,
+                            int count,
+                            float* dst) const
+{
+    assert(pixelComponentCount == 3 || pixelComponentCount == 4);
+    const LumaEnum luma = _tables ? _tables->luma : eLumaRec709Float;
+
+    // one loop per formula, so that the compiler can vectorize it
+    const float* p = pixelData;
+    switch (luma) {
+    case eLumaRec709Float:
+        for (int x = 0; x < count; ++x, p += pixelComponentCount) {
+            dst[x] = luminance(eLumaRec709Float, p);
+        }
+        break;
+    case eLumaRec709Double:
+        for (int x = 0; x < count; ++x, p += pixelComponentCount) {
+            dst[x] = luminance(eLumaRec709Double, p);
+        }
+        break;
+    case eLumaRec601Float:
+        for (int x = 0; x < count; ++x, p += pixelComponentCount) {
+            dst[x] = luminance(eLumaRec601Float, p);
+        }
+        break;
+    default:
+        for (int x = 0; x < count; ++x, p += pixelComponentCount) {
+            dst[x] = luminance(eLumaRec601Double, p);
+        }
+        break;
+    }
+}
+
+void
+SRGBConverter::to_byte_packed_nodither(const void* pixelData,
+                                       const OfxRectI & bounds,
+                                       OFX::PixelComponentEnum pixelComponents,
+                                       int pixelComponentCount,
+                                       OFX::BitDepthEnum bitDepth,
+                                       int rowBytes,
+                                       const OfxRectI & renderWindow,
+                                       void* dstPixelData,
+                                       const OfxRectI & dstBounds,
+                                       OFX::PixelComponentEnum dstPixelComponents,
+                                       int dstPixelComponentCount,
+                                       OFX::BitDepthEnum dstBitDepth,
+                                       int dstRowBytes) const
+{
+    if ( _tables && (bitDepth == eBitDepthFloat) && (dstBitDepth == eBitDepthUByte) &&
+         ( (pixelComponents == ePixelComponentRGBA && pixelComponentCount == 4) || (pixelComponents == ePixelComponentRGB && pixelComponentCount == 3) ) &&
+         ( (dstPixelComponents == ePixelComponentRGBA && dstPixelComponentCount == 4) || (dstPixelComponents == ePixelComponentRGB && dstPixelComponentCount == 3) ) &&
+         (dstPixelComponentCount <= pixelComponentCount) ) {
+        toBytePacked( (const float*)pixelData, bounds, pixelComponentCount, rowBytes, renderWindow,
+                      (unsigned char*)dstPixelData, dstBounds, dstPixelComponentCount, dstRowBytes );
+
+        return;
+    }
+    _lut->to_byte_packed_nodither(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
+                                  renderWindow,
+                                  dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+}
+
+void
+SRGBConverter::to_byte_grayscale_nodither(const void* pixelData,
+                                          const OfxRectI & bounds,
+                                          OFX::PixelComponentEnum pixelComponents,
+                                          int pixelComponentCount,
+                                          OFX::BitDepthEnum bitDepth,
+                                          int rowBytes,
+                                          const OfxRectI & renderWindow,
+                                          void* dstPixelData,
+                                          const OfxRectI & dstBounds,
+                                          OFX::PixelComponentEnum dstPixelComponents,
+                                          int dstPixelComponentCount,
+                                          OFX::BitDepthEnum dstBitDepth,
+                                          int dstRowBytes) const
+{
+    if ( _tables && (bitDepth == eBitDepthFloat) && (dstBitDepth == eBitDepthUByte) &&
+         ( (pixelComponents == ePixelComponentRGBA && pixelComponentCount == 4) || (pixelComponents == ePixelComponentRGB && pixelComponentCount == 3) ) &&
+         (dstPixelComponents == ePixelComponentAlpha) && (dstPixelComponentCount == 1) ) {
+        toByteGrayscale( (const float*)pixelData, bounds, pixelComponentCount, rowBytes,
+                         renderWindow, (unsigned char*)dstPixelData, dstBounds, dstRowBytes );
+
+        return;
+    }
+    _lut->to_byte_grayscale_nodither(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
+                                     renderWindow,
+                                     dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+}
+
+void
+SRGBConverter::from_byte_packed(const void* pixelData,
+                                const OfxRectI & bounds,
+                                OFX::PixelComponentEnum pixelComponents,
+                                int pixelComponentCount,
+                                OFX::BitDepthEnum bitDepth,
+                                int rowBytes,
+                                const OfxRectI & renderWindow,
+                                void* dstPixelData,
+                                const OfxRectI & dstBounds,
+                                OFX::PixelComponentEnum dstPixelComponents,
+                                int dstPixelComponentCount,
+                                OFX::BitDepthEnum dstBitDepth,
+                                int dstRowBytes) const
+{
+    if ( _tables && (bitDepth == eBitDepthUByte) && (dstBitDepth == eBitDepthFloat) &&
+         ( (pixelComponents == ePixelComponentRGBA && pixelComponentCount == 4) || (pixelComponents == ePixelComponentRGB && pixelComponentCount == 3) ) &&
+         (dstPixelComponents == pixelComponents) && (dstPixelComponentCount == pixelComponentCount) ) {
+        fromBytePacked( (const unsigned char*)pixelData, bounds, pixelComponentCount, rowBytes, renderWindow,
+                        (float*)dstPixelData, dstBounds, dstRowBytes );
+
+        return;
+    }
+    _lut->from_byte_packed(pixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes,
+                           renderWindow,
+                           dstPixelData, dstBounds, dstPixelComponents, dstPixelComponentCount, dstBitDepth, dstRowBytes);
+}
@@ -0,0 +1,173 @@
+/*
+   OFX sRGB conversion engine for the OpenCV plugins.
+
+   Copyright (C) 2014 INRIA
+
+   Redistribution and use in source and binary forms, with or without modification,
+   are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+   Redistributions in binary form must reproduce the above copyright notice, this
+   list of conditions and the following disclaimer in the documentation and/or
+   other materials provided with the distribution.
+
+   Neither the name of the {organization} nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   INRIA
+   Domaine de Voluceau
+   Rocquencourt - B.P. 105
+   78153 Le Chesnay Cedex - France
+ */
+
+#ifndef __SRGBConverter_h__
+#define __SRGBConverter_h__
+
+#include "ofxsImageEffect.h"
+
+#include <vector>
+
+namespace OFX {
+namespace Color {
+class Lut;
+}
+}
+
+/**
+ * @brief Vectorized (SSE4.1/AVX2, selected at runtime) replacement for the 8-bit conversions of an OFX::Color::Lut,
+ * with a scalar fallback for other CPUs.
+ *
+ * The conversion tables are derived from the conversions of the Lut itself, once for each Lut, and are shared by all
+ * the converters of this Lut. The kernels give exactly the same bytes as the Lut, which is checked by SRGBConverterTest
+ * for every kernel. The layouts that are not handled are converted by the Lut, and so is everything when the tables
+ * cannot be derived from the Lut (the converter is then scalar, and never throws).
+ **/
+class SRGBConverter
+{
+public:
+    enum KernelEnum
+    {
+        eKernelScalar = 0,
+        eKernelSSE41,
+        eKernelAVX2
+    };
+
+    /// a converter using the fastest kernel supported by the CPU
+    explicit SRGBConverter(const OFX::Color::Lut* lut);
+
+    /// a converter using the given kernel, which must be supported by the CPU
+    SRGBConverter(const OFX::Color::Lut* lut, KernelEnum kernel);
+
+    static bool isKernelSupported(KernelEnum kernel);
+
+    KernelEnum getKernel() const
+    {
+        return _kernel;
+    }
+
+    /// same as OFX::Color::Lut::to_byte_packed_nodither
+    void to_byte_packed_nodither(const void* pixelData,
+                                 const OfxRectI & bounds,
+                                 OFX::PixelComponentEnum pixelComponents,
+                                 int pixelComponentCount,
+                                 OFX::BitDepthEnum bitDepth,
+                                 int rowBytes,
+                                 const OfxRectI & renderWindow,
+                                 void* dstPixelData,
+                                 const OfxRectI & dstBounds,
+                                 OFX::PixelComponentEnum dstPixelComponents,
+                                 int dstPixelComponentCount,
+                                 OFX::BitDepthEnum dstBitDepth,
+                                 int dstRowBytes) const;
+
+    /// same as OFX::Color::Lut::to_byte_grayscale_nodither
+    void to_byte_grayscale_nodither(const void* pixelData,
+                                    const OfxRectI & bounds,
+                                    OFX::PixelComponentEnum pixelComponents,
+                                    int pixelComponentCount,
+                                    OFX::BitDepthEnum bitDepth,
+                                    int rowBytes,
+                                    const OfxRectI & renderWindow,
+                                    void* dstPixelData,
+                                    const OfxRectI & dstBounds,
+                                    OFX::PixelComponentEnum dstPixelComponents,
+                                    int dstPixelComponentCount,
+                                    OFX::BitDepthEnum dstBitDepth,
+                                    int dstRowBytes) const;
+
+    /// same as OFX::Color::Lut::from_byte_packed
+    void from_byte_packed(const void* pixelData,
+                          const OfxRectI & bounds,
+                          OFX::PixelComponentEnum pixelComponents,
+                          int pixelComponentCount,
+                          OFX::BitDepthEnum bitDepth,
+                          int rowBytes,
+                          const OfxRectI & renderWindow,
+                          void* dstPixelData,
+                          const OfxRectI & dstBounds,
+                          OFX::PixelComponentEnum dstPixelComponents,
+                          int dstPixelComponentCount,
+                          OFX::BitDepthEnum dstBitDepth,
+                          int dstRowBytes) const;
+
+    /**
+     * @brief The luminance of count RGB or RGBA float pixels, with the formula of to_byte_grayscale_nodither, so that
+     * float and 8-bit grayscale images agree. It is Rec.709 if the formula of the Lut is unknown.
+     **/
+    void to_luminance(const float* pixelData,
+                      int pixelComponentCount,
+                      int count,
+                      float* dst) const;
+
+    // the conversion tables of a Lut, shared by all its converters
+    struct Tables;
+
+private:
+    void toBytePacked(const float* pixelData,
+                      const OfxRectI & bounds,
+                      int pixelComponentCount,
+                      int rowBytes,
+                      const OfxRectI & renderWindow,
+                      unsigned char* dstPixelData,
+                      const OfxRectI & dstBounds,
+                      int dstPixelComponentCount,
+                      int dstRowBytes) const;
+
+    void toByteGrayscale(const float* pixelData,
+                         const OfxRectI & bounds,
+                         int pixelComponentCount,
+                         int rowBytes,
+                         const OfxRectI & renderWindow,
+                         unsigned char* dstPixelData,
+                         const OfxRectI & dstBounds,
+                         int dstRowBytes) const;
+
+    void fromBytePacked(const unsigned char* pixelData,
+                        const OfxRectI & bounds,
+                        int pixelComponentCount,
+                        int rowBytes,
+                        const OfxRectI & renderWindow,
+                        float* dstPixelData,
+                        const OfxRectI & dstBounds,
+                        int dstRowBytes) const;
+
+    const OFX::Color::Lut* _lut;
+    const Tables* _tables; // shared by the converters of _lut
+    KernelEnum _kernel;
+};
+
+#endif /* defined(__SRGBConverter_h__) */
@@ -0,0 +1,373 @@
+/*
+   Bit-exact test of the SRGBConverter kernels against the OFX::Color::Lut they replace.
+
+   Copyright (C) 2014 INRIA
+
+   Redistribution and use in source and binary forms, with or without modification,
+   are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+   Redistributions in binary form must reproduce the above copyright notice, this
+   list of conditions and the following disclaimer in the documentation and/or
+   other materials provided with the distribution.
+
+   Neither the name of the {organization} nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   INRIA
+   Domaine de Voluceau
+   Rocquencourt - B.P. 105
+   78153 Le Chesnay Cedex - France
+ */
+#include "SRGBConverter.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "ofxsLut.h"
+#include "fast_mutex.h"
+
+using namespace OFX;
+
+// the rows of the test images, not a multiple of the vector widths so that the kernels convert partial vectors
+#define kRowWidth 1021
+// number of float values converted at once
+#define kChunkValues (kRowWidth * 1024)
+// number of pseudo-random pixels of the grayscale test
+#define kRandomPixelCount 65536
+
+static const char*
+kernelName(SRGBConverter::KernelEnum kernel)
+{
+    switch (kernel) {
+    case SRGBConverter::eKernelScalar:
+        return "scalar";
+    case SRGBConverter::eKernelSSE41:
+        return "SSE4.1";
+    case SRGBConverter::eKernelAVX2:
+        return "AVX2";
+    }
+
+    return "?";
+}
+
+static inline float
+bitsFloat(unsigned int bits)
+{
+    float v;
+
+    std::memcpy( &v, &bits, sizeof(v) );
+
+    return v;
+}
+
+static inline unsigned int
+floatBits(float v)
+{
+    unsigned int bits;
+
+    std::memcpy( &bits, &v, sizeof(bits) );
+
+    return bits;
+}
+
+static unsigned char
+lutToByte(const Color::Lut* lut,
+          float v,
+          bool alpha)
+{
+    const OfxRectI bounds = {0, 0, 1, 1};
+    float src[4] = {v, v, v, v};
+    unsigned char dst[4];
+
+    lut->to_byte_packed_nodither(src, bounds, ePixelComponentRGBA, 4, eBitDepthFloat, sizeof(src),
+                                 bounds,
+                                 dst, bounds, ePixelComponentRGBA, 4, eBitDepthUByte, sizeof(dst));
+
+    return alpha ? dst[3] : dst[0];
+}
+
+/**
+ * @brief The values tested by --quick: the special values, the first and last float of each group of floats with the
+ * same 16 high bits (the buckets of the conversion tables), and both sides of each point where the Lut changes its
+ * result inside a bucket, found independently of the tables.
+ **/
+static void
+buildBoundaryValues(const Color::Lut* lut,
+                    std::vector<unsigned int>* values)
+{
+    const unsigned int specials[] = {
+        0x00000000, 0x80000000, // +0, -0
+        0x00000001, 0x80000001, 0x007fffff, 0x00800000, // denormals, smallest normal
+        0x3f000000, 0x3f800000, 0x40000000, 0xbf800000, // 0.5, 1, 2, -1
+        0x7f7fffff, 0xff7fffff, // +-max
+        0x7f800000, 0xff800000, // +-inf
+        0x7f800001, 0x7fc00000, 0x7fffffff, 0xff800001, 0xffc00000, 0xffffffff // NaNs
+    };
+
+    values->assign( specials, specials + sizeof(specials) / sizeof(specials[0]) );
+    for (unsigned int sign = 0; sign < 2; ++sign) {
+        for (unsigned int bucket = 0; bucket < 0x8000; ++bucket) {
+            const unsigned int start = (sign << 31) | (bucket << 16);
+            const unsigned int end = start + 0xffff;
+            values->push_back(start);
+            values->push_back(end);
+            for (int alpha = 0; alpha < 2; ++alpha) {
+                // the last float that converts as the start of the bucket
+                const unsigned char first = lutToByte(lut, bitsFloat(start), alpha != 0);
+                if ( (bitsFloat(start) != bitsFloat(start)) || (lutToByte(lut, bitsFloat(end), alpha != 0) == first) ) {
+                    continue;
+                }
+                unsigned int lo = start;
+                unsigned int hi = end;
+                while (hi - lo > 1) {
+                    unsigned int mid = lo + (hi - lo) / 2;
+                    if (lutToByte(lut, bitsFloat(mid), alpha != 0) == first) {
+                        lo = mid;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                values->push_back(lo);
+                values->push_back(hi);
+            }
+        }
+    }
+}
+
+// reports the first difference between expected and result, which hold the conversions of the values
+static bool
+checkBytes(const char* test,
+           SRGBConverter::KernelEnum kernel,
+           const std::vector<unsigned char> & expected,
+           const std::vector<unsigned char> & result,
+           const std::vector<float> & src,
+           int srcCount,
+           int dstCount)
+{
+    if (result == expected) {
+        return true;
+    }
+    std::size_t i = 0;
+    while (result[i] == expected[i]) {
+        ++i;
+    }
+    const std::size_t pixel = i / dstCount;
+    std::printf("FAILED %s, %s kernel: pixel %u component %u, source", test, kernelName(kernel), (unsigned int)pixel, (unsigned int)(i % dstCount) );
+    for (int c = 0; c < srcCount; ++c) {
+        std::printf(" 0x%08x", floatBits(src[pixel * srcCount + c]) );
+    }
+    std::printf(": Lut %d, converter %d\n", expected[i], result[i]);
+
+    return false;
+}
+
+/**
+ * @brief Convert the given values with the Lut and with each converter, in every packed layout. With a 4 components
+ * source, each value is converted in every component.
+ **/
+static bool
+testToBytePacked(const Color::Lut* lut,
+                 const std::vector<SRGBConverter*> & converters,
+                 const std::vector<float> & values,
+                 bool allLayouts)
+{
+    const int height = ( (int)values.size() + kRowWidth - 1 ) / kRowWidth;
+    const OfxRectI bounds = {0, 0, kRowWidth, height};
+    bool ok = true;
+
+    for (int srcCount = 4; srcCount >= 3; --srcCount) {
+        const PixelComponentEnum srcComponents = (srcCount == 4) ? ePixelComponentRGBA : ePixelComponentRGB;
+        for (int dstCount = srcCount; dstCount >= 3; --dstCount) {
+            if ( !allLayouts && ( (srcCount != 4) || (dstCount != 4) ) ) {
+                continue;
+            }
+            const PixelComponentEnum dstComponents = (dstCount == 4) ? ePixelComponentRGBA : ePixelComponentRGB;
+            std::vector<float> src(kRowWidth * height * srcCount, 0.f);
+            std::vector<unsigned char> expected(kRowWidth * height * dstCount);
+            std::vector<unsigned char> result(kRowWidth * height * dstCount);
+            const int rotations = (srcCount == 4) ? 4 : 1;
+            for (int r = 0; r < rotations && ok; ++r) {
+                for (std::size_t i = 0; i < src.size(); ++i) {
+                    src[i] = values[(i / srcCount * srcCount + (i + r) % srcCount) % values.size()];
+                }
+                lut->to_byte_packed_nodither(&src[0], bounds, srcComponents, srcCount, eBitDepthFloat, kRowWidth * srcCount * sizeof(float),
+                                             bounds,
+                                             &expected[0], bounds, dstComponents, dstCount, eBitDepthUByte, kRowWidth * dstCount);
+                for (std::size_t k = 0; k < converters.size() && ok; ++k) {
+                    converters[k]->to_byte_packed_nodither(&src[0], bounds, srcComponents, srcCount, eBitDepthFloat, kRowWidth * srcCount * sizeof(float),
+                                                           bounds,
+                                                           &result[0], bounds, dstComponents, dstCount, eBitDepthUByte, kRowWidth * dstCount);
+                    ok = checkBytes(srcCount == dstCount ? "to_byte_packed_nodither" : "to_byte_packed_nodither RGBA to RGB", converters[k]->getKernel(),
+                                    expected, result, src, srcCount, dstCount);
+                }
+            }
+        }
+    }
+
+    return ok;
+}
+
+// grayscale conversion of gray pixels made of the given values, then of pseudo-random pixels
+static bool
+testToByteGrayscale(const Color::Lut* lut,
+                    const std::vector<SRGBConverter*> & converters,
+                    const std::vector<float> & values)
+{
+    const int height = ( (int)values.size() + kRandomPixelCount + kRowWidth - 1 ) / kRowWidth;
+    const OfxRectI bounds = {0, 0, kRowWidth, height};
+    const std::size_t pixelCount = (std::size_t)kRowWidth * height;
+    bool ok = true;
+
+    for (int srcCount = 4; srcCount >= 3 && ok; --srcCount) {
+        const PixelComponentEnum srcComponents = (srcCount == 4) ? ePixelComponentRGBA : ePixelComponentRGB;
+        std::vector<float> src(pixelCount * srcCount);
+        unsigned int seed = 1;
+        for (std::size_t x = 0; x < pixelCount; ++x) {
+            for (int c = 0; c < srcCount; ++c) {
+                if ( x < values.size() ) {
+                    src[x * srcCount + c] = values[x];
+                } else {
+                    seed = seed * 1664525u + 1013904223u;
+                    src[x * srcCount + c] = -0.25f + 1.5f * (float)(seed >> 8) / (float)(1 << 24);
+                }
+            }
+        }
+        std::vector<unsigned char> expected(pixelCount);
+        std::vector<unsigned char> result(pixelCount);
+        lut->to_byte_grayscale_nodither(&src[0], bounds, srcComponents, srcCount, eBitDepthFloat, kRowWidth * srcCount * sizeof(float),
+                                        bounds,
+                                        &expected[0], bounds, ePixelComponentAlpha, 1, eBitDepthUByte, kRowWidth);
+        for (std::size_t k = 0; k < converters.size() && ok; ++k) {
+            converters[k]->to_byte_grayscale_nodither(&src[0], bounds, srcComponents, srcCount, eBitDepthFloat, kRowWidth * srcCount * sizeof(float),
+                                                      bounds,
+                                                      &result[0], bounds, ePixelComponentAlpha, 1, eBitDepthUByte, kRowWidth);
+            ok = checkBytes("to_byte_grayscale_nodither", converters[k]->getKernel(), expected, result, src, srcCount, 1);
+        }
+
+        // the float luminance gives the same bytes once converted by the Lut
+        std::vector<float> lum(pixelCount);
+        std::vector<float> gray(pixelCount * 3);
+        std::vector<unsigned char> grayBytes(pixelCount * 3);
+        for (std::size_t k = 0; k < converters.size() && ok; ++k) {
+            converters[k]->to_luminance(&src[0], srcCount, (int)pixelCount, &lum[0]);
+            for (std::size_t x = 0; x < pixelCount; ++x) {
+                gray[x * 3] = gray[x * 3 + 1] = gray[x * 3 + 2] = lum[x];
+            }
+            lut->to_byte_packed_nodither(&gray[0], bounds, ePixelComponentRGB, 3, eBitDepthFloat, kRowWidth * 3 * sizeof(float),
+                                         bounds,
+                                         &grayBytes[0], bounds, ePixelComponentRGB, 3, eBitDepthUByte, kRowWidth * 3);
+            for (std::size_t x = 0; x < pixelCount; ++x) {
+                result[x] = grayBytes[x * 3];
+            }
+            ok = checkBytes("to_luminance", converters[k]->getKernel(), expected, result, src, srcCount, 1);
+        }
+    }
+
+    return ok;
+}
+
+// every byte value in every component
+static bool
+testFromBytePacked(const Color::Lut* lut,
+                   const std::vector<SRGBConverter*> & converters)
+{
+    const OfxRectI bounds = {0, 0, 256, 1};
+    bool ok = true;
+
+    for (int count = 4; count >= 3 && ok; --count) {
+        const PixelComponentEnum components = (count == 4) ? ePixelComponentRGBA : ePixelComponentRGB;
+        std::vector<unsigned char> src(256 * count);
+        for (int x = 0; x < 256; ++x) {
+            for (int c = 0; c < count; ++c) {
+                src[x * count + c] = (unsigned char)( (x + c * 7) % 256 );
+            }
+        }
+        std::vector<float> expected(256 * count);
+        std::vector<float> result(256 * count);
+        lut->from_byte_packed(&src[0], bounds, components, count, eBitDepthUByte, 256 * count,
+                              bounds,
+                              &expected[0], bounds, components, count, eBitDepthFloat, 256 * count * sizeof(float));
+        for (std::size_t k = 0; k < converters.size() && ok; ++k) {
+            converters[k]->from_byte_packed(&src[0], bounds, components, count, eBitDepthUByte, 256 * count,
+                                            bounds,
+                                            &result[0], bounds, components, count, eBitDepthFloat, 256 * count * sizeof(float));
+            for (std::size_t i = 0; i < result.size() && ok; ++i) {
+                if ( floatBits(result[i]) != floatBits(expected[i]) ) {
+                    std::printf("FAILED from_byte_packed, %s kernel: byte %d component %d: Lut 0x%08x, converter 0x%08x\n",
+                                kernelName( converters[k]->getKernel() ), src[i], (int)(i % count), floatBits(expected[i]), floatBits(result[i]) );
+                    ok = false;
+                }
+            }
+        }
+    }
+
+    return ok;
+}
+
+int
+main(int argc,
+     char** argv)
+{
+    const bool quick = (argc > 1) && (std::strcmp(argv[1], "--quick") == 0);
+    Color::LutManager<tthread::fast_mutex> lutManager;
+    const Color::Lut* lut = lutManager.sRGBLut();
+
+    std::vector<SRGBConverter*> converters;
+    const SRGBConverter::KernelEnum kernels[] = {
+        SRGBConverter::eKernelScalar, SRGBConverter::eKernelSSE41, SRGBConverter::eKernelAVX2
+    };
+    for (int k = 0; k < 3; ++k) {
+        if ( SRGBConverter::isKernelSupported(kernels[k]) ) {
+            converters.push_back( new SRGBConverter(lut, kernels[k]) );
+        } else {
+            std::printf("%s kernel not supported by this CPU, not tested\n", kernelName(kernels[k]) );
+        }
+    }
+
+    std::vector<unsigned int> boundaries;
+    buildBoundaryValues(lut, &boundaries);
+    std::vector<float> values( boundaries.size() );
+    for (std::size_t i = 0; i < boundaries.size(); ++i) {
+        values[i] = bitsFloat(boundaries[i]);
+    }
+
+    bool ok = testToBytePacked(lut, converters, values, true) &&
+              testToByteGrayscale(lut, converters, values) &&
+              testFromBytePacked(lut, converters);
+
+    if (ok && !quick) {
+        // every float, in every component of RGBA pixels
+        values.resize(kChunkValues);
+        for (unsigned long long start = 0; start < (1ULL << 32) && ok; start += kChunkValues) {
+            for (std::size_t i = 0; i < values.size(); ++i) {
+                values[i] = bitsFloat( (unsigned int)(start + i) );
+            }
+            ok = testToBytePacked(lut, converters, values, false);
+        }
+    }
+
+    for (std::size_t k = 0; k < converters.size(); ++k) {
+        delete converters[k];
+    }
+    std::printf(ok ? "SRGBConverter: all kernels match the Lut%s\n" : "SRGBConverter: FAILED%s\n", quick ? " (quick)" : "");
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
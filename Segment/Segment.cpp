@@ -0,0 +1,1175 @@
+/*
+   OFX Segment plugin.
+
+   Copyright (C) 2014 INRIA
+
+   Redistribution and use in source and binary forms, with or without modification,
+   are permitted provided that the following conditions are met:
+
+   Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+   Redistributions in binary form must reproduce the above copyright notice, this
+   list of conditions and the following disclaimer in the documentation and/or
+   other materials provided with the distribution.
+
+   Neither the name of the {organization} nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   INRIA
+   Domaine de Voluceau
+   Rocquencourt - B.P. 105
+   78153 Le Chesnay Cedex - France
+
+
+   The skeleton for this source file is from:
+   OFX Invert Example plugin, a plugin that illustrates the use of the OFX Support library.
+
+   Copyright (C) 2007 The Open Effects Association Ltd
+   Author Bruno Nicoletti bruno@thefoundry.co.uk
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name The Open Effects Association Ltd, nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+   ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+   The Open Effects Association Ltd
+   1 Wardour St
+   London W1D 6PA
+   England
+
+
+ */
+
+#include "GenericOpenCVPlugin.h"
+
+#include <ofxsLut.h>
+
+#if CV_MAJOR_VERSION < 3
+// cvPyrSegmentation is in the legacy module, which was removed in OpenCV 3
+#include <opencv2/legacy/legacy.hpp>
+#define SEGMENT_WITH_PYR_SEGMENTATION
+#else
+// the superpixel and graph segmentations are in the ximgproc module of opencv_contrib, which may not be installed
+#include <opencv2/opencv_modules.hpp>
+#ifdef HAVE_OPENCV_XIMGPROC
+#include <opencv2/ximgproc.hpp>
+#define SEGMENT_WITH_XIMGPROC
+#endif
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
+using namespace OFX;
+
+OFXS_NAMESPACE_ANONYMOUS_ENTER;
+
+// declared in this namespace so that they are not ambiguous with cv::Mutex
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+#define kPluginName "SegmentOFX"
+#define kPluginGrouping "Filter"
+#define kPluginDescription "Segment the input into regions of uniform color, using OpenCV.\n" \
+    "Ported from the segment plugin of opencv2fx by Bernd Porr."
+#define kPluginIdentifier "net.sf.openfx.Segment"
+#define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
+#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+
+// the segmentation links the regions across the whole frame, so the whole input is segmented once per render
+#define kSupportsTiles 0
+#define kSupportsMultiResolution 1
+#define kSupportsRenderScale 1
+#define kRenderThreadSafety eRenderFullySafe
+
+#define kParamMethod "method"
+#define kParamMethodLabel "Method"
+#define kParamMethodHint "Segmentation algorithm. Pyramid requires OpenCV 2, SLIC Superpixels and Graph require the ximgproc module of " \
+    "opencv_contrib: a method that was not available when the plugin was compiled renders an error."
+#define kParamMethodOptionPyramid "Pyramid"
+#define kParamMethodOptionPyramidHint "Pyramid segmentation of OpenCV 2 (cvPyrSegmentation), as in the original plugin. Slow on large images."
+#define kParamMethodOptionMeanShift "Mean Shift"
+#define kParamMethodOptionMeanShiftHint "Mean shift filtering, computed in parallel horizontal bands."
+#define kParamMethodOptionSLIC "SLIC Superpixels"
+#define kParamMethodOptionSLICHint "Superpixels of about the same size, which follow the edges of the image. Each superpixel gets its mean color."
+#define kParamMethodOptionGraph "Graph"
+#define kParamMethodOptionGraphHint "Graph-based segmentation by Felzenszwalb and Huttenlocher. Each region gets its mean color."
+
+// Pyramid
+#define kParamLinkThreshold "linkThreshold"
+#define kParamLinkThresholdLabel "Link Threshold"
+#define kParamLinkThresholdHint "Color distance below which a pixel is linked to a region of the next level of the pyramid"
+
+// Pyramid
+#define kParamClusterThreshold "clusterThreshold"
+#define kParamClusterThresholdLabel "Cluster Threshold"
+#define kParamClusterThresholdHint "Color distance below which neighboring regions are merged"
+
+// Pyramid
+#define kParamPyramidLevels "pyramidLevels"
+#define kParamPyramidLevelsLabel "Levels"
+#define kParamPyramidLevelsHint "Number of levels of the pyramid. More levels give larger regions, but are slower."
+
+// Mean Shift
+#define kParamSpatialRadius "spatialRadius"
+#define kParamSpatialRadiusLabel "Spatial Radius"
+#define kParamSpatialRadiusHint "Radius of the spatial window of the mean shift, in full resolution pixels. Larger values give smoother regions, but are slower."
+
+// Mean Shift
+#define kParamColorRadius "colorRadius"
+#define kParamColorRadiusLabel "Color Radius"
+#define kParamColorRadiusHint "Radius of the color window of the mean shift: colors closer than this are merged."
+
+// Mean Shift
+#define kParamMeanShiftLevels "meanShiftLevels"
+#define kParamMeanShiftLevelsLabel "Levels"
+#define kParamMeanShiftLevelsHint "Number of pyramid levels above the full image. The mean shift converges on the coarse levels first, which is faster on large " \
+    "regions."
+
+// Mean Shift && SLIC
+#define kParamIterations "iterations"
+#define kParamIterationsLabel "Iterations"
+#define kParamIterationsHint "Maximum number of iterations. Fewer iterations are faster, but the regions are less accurate."
+
+// SLIC
+#define kParamRegionSize "regionSize"
+#define kParamRegionSizeLabel "Region Size"
+#define kParamRegionSizeHint "Average size of the superpixels, in full resolution pixels."
+
+// SLIC
+#define kParamRuler "ruler"
+#define kParamRulerLabel "Compactness"
+#define kParamRulerHint "Higher values give more regular superpixels, lower values make them follow the edges more closely."
+
+// Graph
+#define kParamSigma "sigma"
+#define kParamSigmaLabel "Sigma"
+#define kParamSigmaHint "Standard deviation of the Gaussian that smoothes the image before the segmentation, in full resolution pixels."
+
+// Graph
+#define kParamK "k"
+#define kParamKLabel "K"
+#define kParamKHint "Scale of the segmentation: higher values give larger regions."
+
+// Graph
+#define kParamMinSize "minSize"
+#define kParamMinSizeLabel "Min Size"
+#define kParamMinSizeHint "Minimum area of a region, in full resolution pixels. Smaller regions are merged with their neighbors."
+
+// the mean shift bands are this high, or a bit more so that they start on the coarsest level of the pyramid.
+// They do not depend on the number of CPUs, so that the result does not depend on the machine.
+#define kMeanShiftBandHeight 128
+
+#define kParamTemporal "temporal"
+#define kParamTemporalLabel "Temporal Coherence"
+#define kParamTemporalHint "Start from the segmentation of the previously rendered frame, and only segment again the regions of the input " \
+    "that changed. The regions are more stable over time, and static shots are much faster, but the result depends on the order " \
+    "in which the frames are rendered."
+
+#define kParamChangeThreshold "changeThreshold"
+#define kParamChangeThresholdLabel "Change Threshold"
+#define kParamChangeThresholdHint "Difference of color (from 0 to 255) above which a pixel is segmented again in the temporal coherence mode."
+
+// the changed regions are segmented again with this context around them, in full resolution pixels
+#define kTemporalMargin 16
+
+// above this fraction of changed pixels, the whole frame is segmented again
+#define kTemporalMaxChangedFraction 0.5
+
+// the order of the options of the choice param, which does not depend on the compiled methods so that projects stay portable
+enum SegmentationMethodEnum
+{
+    eSegmentationPyramid = 0,
+    eSegmentationMeanShift,
+    eSegmentationSLIC,
+    eSegmentationGraph
+};
+
+#ifdef SEGMENT_WITH_PYR_SEGMENTATION
+#define kParamMethodDefault eSegmentationPyramid
+#else
+#define kParamMethodDefault eSegmentationMeanShift
+#endif
+
+static SegmentationMethodEnum
+methodFromOption(int option)
+{
+    if ( (option < (int)eSegmentationPyramid) || (option > (int)eSegmentationGraph) ) {
+        return kParamMethodDefault;
+    }
+
+    return (SegmentationMethodEnum)option;
+}
+
+// whether the method was available when the plugin was compiled
+static bool
+isMethodAvailable(SegmentationMethodEnum method)
+{
+    switch (method) {
+    case eSegmentationPyramid:
+#ifdef SEGMENT_WITH_PYR_SEGMENTATION
+        return true;
+#else
+        return false;
+#endif
+    case eSegmentationMeanShift:
+        return true;
+    case eSegmentationSLIC:
+    case eSegmentationGraph:
+#ifdef SEGMENT_WITH_XIMGPROC
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+static OFX::Color::LutManager<Mutex>* gLutManager;
+
+/**
+ * @brief Fill each region of labels with the mean color of rgb over that region.
+ **/
+static void
+fillLabelMeans(const cv::Mat & rgb,
+               const cv::Mat & labels,
+               int labelsCount,
+               cv::Mat* segmented)
+{
+    assert(rgb.type() == CV_8UC3 && labels.type() == CV_32SC1 && rgb.size() == labels.size());
+    // r, g, b and count of each label
+    std::vector<double> sums(4 * labelsCount, 0.);
+
+    for (int y = 0; y < rgb.rows; ++y) {
+        const unsigned char* pix = rgb.ptr<unsigned char>(y);
+        const int* label = labels.ptr<int>(y);
+        for (int x = 0; x < rgb.cols; ++x, pix += 3) {
+            double* sum = &sums[4 * label[x]];
+            sum[0] += pix[0];
+            sum[1] += pix[1];
+            sum[2] += pix[2];
+            sum[3] += 1.;
+        }
+    }
+    std::vector<unsigned char> means(3 * labelsCount, 0);
+    for (int l = 0; l < labelsCount; ++l) {
+        const double* sum = &sums[4 * l];
+        if (sum[3] > 0.) {
+            for (int c = 0; c < 3; ++c) {
+                means[3 * l + c] = (unsigned char)(sum[c] / sum[3] + 0.5);
+            }
+        }
+    }
+    segmented->create(rgb.size(), CV_8UC3);
+    for (int y = 0; y < rgb.rows; ++y) {
+        unsigned char* pix = segmented->ptr<unsigned char>(y);
+        const int* label = labels.ptr<int>(y);
+        for (int x = 0; x < rgb.cols; ++x, pix += 3) {
+            const unsigned char* mean = &means[3 * label[x]];
+            pix[0] = mean[0];
+            pix[1] = mean[1];
+            pix[2] = mean[2];
+        }
+    }
+}
+
+/**
+ * @brief Mean shift filtering of an image, cut in horizontal bands that are filtered in parallel. Each band is filtered
+ * with halo rows above and below it, which hold every pixel read by the coarsest level through all its iterations. The
+ * finer levels refine the upsampled result further, so the bands mostly agree where they meet but are not guaranteed to
+ * be identical to a filtering of the whole image.
+ **/
+class MeanShiftProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    // the matrices must stay valid until process() returns
+    MeanShiftProcessor(const cv::Mat & rgb,
+                       double spatialRadius,
+                       double colorRadius,
+                       int levels,
+                       int iterations,
+                       cv::Mat* result)
+    : _rgb(rgb)
+    , _spatialRadius(spatialRadius)
+    , _colorRadius(colorRadius)
+    , _levels(levels)
+    , _iterations(iterations)
+    , _result(result)
+    , _bandHeight(0)
+    , _halo(0)
+    , _mutex()
+    , _failed(false)
+    {
+    }
+
+    void process()
+    {
+        const int align = 1 << _levels;
+
+        // each iteration of the coarsest level moves a pixel by at most spatialRadius and reads spatialRadius pixels
+        // around it, plus the support of the pyramid filter
+        _halo = ( _iterations * (int)std::ceil(_spatialRadius) + 2 ) << _levels;
+        _bandHeight = (kMeanShiftBandHeight + align - 1) / align * align;
+        _result->create( _rgb.size(), _rgb.type() );
+
+        const unsigned int nBands = (unsigned int)( (_rgb.rows + _bandHeight - 1) / _bandHeight );
+        if (nBands == 0) {
+            return;
+        }
+        multiThread( std::min(OFX::MultiThread::getNumCPUs(), nBands) );
+        if (_failed) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        // the host may give us less threads than we asked for
+        for (int y = (int)threadID * _bandHeight; y < _rgb.rows; y += (int)nThreads * _bandHeight) {
+            try {
+                const int y2 = std::min(y + _bandHeight, _rgb.rows);
+                // the band and its halo start on a multiple of 2^levels, so that its pyramid matches the one of the whole image
+                const int areaY1 = std::max(0, y - _halo);
+                const int areaY2 = std::min(_rgb.rows, y2 + _halo);
+                cv::Mat filtered;
+                cv::pyrMeanShiftFiltering( _rgb.rowRange(areaY1, areaY2), filtered, _spatialRadius, _colorRadius, _levels,
+                                           cv::TermCriteria(cv::TermCriteria::MAX_ITER + cv::TermCriteria::EPS, _iterations, 1) );
+                filtered.rowRange(y - areaY1, y2 - areaY1).copyTo( _result->rowRange(y, y2) );
+            } catch (...) {
+                // exceptions must not cross the host threads
+                AutoMutex l(_mutex);
+                _failed = true;
+            }
+        }
+    }
+
+    const cv::Mat & _rgb;
+    double _spatialRadius;
+    double _colorRadius;
+    int _levels;
+    int _iterations;
+    cv::Mat* _result;
+    int _bandHeight;
+    int _halo;
+    Mutex _mutex;
+    bool _failed;
+};
+
+// the values of the parameters used to segment a frame, with the sizes already scaled by the render scale
+struct SegmentationParams
+{
+    SegmentationMethodEnum method;
+
+    // Pyramid
+    double linkThreshold;
+    double clusterThreshold;
+    int pyramidLevels;
+
+    // Mean Shift
+    double spatialRadius;
+    double colorRadius;
+    int meanShiftLevels;
+
+    // Mean Shift + SLIC
+    int iterations;
+
+    // SLIC
+    int regionSize;
+    double ruler;
+
+    // Graph
+    double sigma;
+    double k;
+    int minSize;
+};
+
+// the values of the parameters that the method uses, to tell whether a segmentation was computed with the same parameters
+static void
+segmentationParamsValues(const SegmentationParams & params,
+                         std::vector<double>* values)
+{
+    values->clear();
+    values->push_back( (double)params.method );
+    switch (params.method) {
+    case eSegmentationPyramid:
+        values->push_back(params.linkThreshold);
+        values->push_back(params.clusterThreshold);
+        values->push_back(params.pyramidLevels);
+        break;
+    case eSegmentationMeanShift:
+        values->push_back(params.spatialRadius);
+        values->push_back(params.colorRadius);
+        values->push_back(params.meanShiftLevels);
+        values->push_back(params.iterations);
+        break;
+    case eSegmentationSLIC:
+        values->push_back(params.iterations);
+        values->push_back(params.regionSize);
+        values->push_back(params.ruler);
+        break;
+    case eSegmentationGraph:
+        values->push_back(params.sigma);
+        values->push_back(params.k);
+        values->push_back(params.minSize);
+        break;
+    }
+}
+
+/**
+ * @brief Segment rgb, which may have any size, with the given method.
+ **/
+static void
+segmentImage(const SegmentationParams & params,
+             const cv::Mat & rgb,
+             cv::Mat* segmented)
+{
+    switch (params.method) {
+    case eSegmentationPyramid: {
+#ifdef SEGMENT_WITH_PYR_SEGMENTATION
+        const int levels = std::max(1, params.pyramidLevels);
+
+        // the pyramid needs a size that is a multiple of 2^levels: the edges are repeated rather than cropped
+        const int block = 1 << levels;
+        const int padX = (block - rgb.cols % block) % block;
+        const int padY = (block - rgb.rows % block) % block;
+        cv::Mat padded = rgb;
+        if ( (padX > 0) || (padY > 0) ) {
+            cv::copyMakeBorder(rgb, padded, 0, padY, 0, padX, cv::BORDER_REPLICATE);
+        }
+
+        cv::Mat result(padded.size(), CV_8UC3);
+        IplImage srcIpl = padded;
+        IplImage dstIpl = result;
+        // the component sequence is not used, the storage only lives for this call
+        CvMemStorage* storage = cvCreateMemStorage(0);
+        CvSeq* comp = NULL;
+        try {
+            cvPyrSegmentation(&srcIpl, &dstIpl, storage, &comp, levels, params.linkThreshold, params.clusterThreshold);
+        } catch (...) {
+            cvReleaseMemStorage(&storage);
+            throw;
+        }
+        cvReleaseMemStorage(&storage);
+        *segmented = result( cv::Rect(0, 0, rgb.cols, rgb.rows) );
+#else
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+#endif
+        break;
+    }
+    case eSegmentationMeanShift: {
+        MeanShiftProcessor processor( rgb, params.spatialRadius, params.colorRadius, std::max(0, params.meanShiftLevels),
+                                      std::max(1, params.iterations), segmented );
+        processor.process();
+        break;
+    }
+    case eSegmentationSLIC: {
+#ifdef SEGMENT_WITH_XIMGPROC
+        // SLIC measures the color distances in Lab
+        cv::Mat lab;
+        cv::cvtColor(rgb, lab, cv::COLOR_RGB2Lab);
+        cv::Ptr<cv::ximgproc::SuperpixelSLIC> slic = cv::ximgproc::createSuperpixelSLIC(lab, cv::ximgproc::SLIC, params.regionSize, (float)params.ruler);
+        slic->iterate( std::max(1, params.iterations) );
+        cv::Mat labels;
+        slic->getLabels(labels);
+        fillLabelMeans( rgb, labels, slic->getNumberOfSuperpixels(), segmented );
+#else
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+#endif
+        break;
+    }
+    case eSegmentationGraph: {
+#ifdef SEGMENT_WITH_XIMGPROC
+        cv::Ptr<cv::ximgproc::segmentation::GraphSegmentation> graph =
+            cv::ximgproc::segmentation::createGraphSegmentation(params.sigma, (float)params.k, params.minSize);
+        cv::Mat labels;
+        graph->processImage(rgb, labels);
+        double maxLabel = 0.;
+        cv::minMaxLoc(labels, NULL, &maxLabel);
+        fillLabelMeans(rgb, labels, (int)maxLabel + 1, segmented);
+#else
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+#endif
+        break;
+    }
+    } // switch
+} // segmentImage
+
+/**
+ * @brief Update a previous segmentation of the same frame size: only the pixels of rgb that differ from reference by more
+ * than changeThreshold on any channel are segmented again, with some context around them. The other pixels keep their
+ * previous region. The reference is updated with the pixels that were segmented again, so that slow changes are caught
+ * up with once they exceed the threshold.
+ * The previous matrices are not modified, since they may be shared with the cache.
+ **/
+static void
+updateSegmentation(const SegmentationParams & params,
+                   const cv::Mat & rgb,
+                   const cv::Mat & previousReference,
+                   const cv::Mat & previousSegmented,
+                   double changeThreshold,
+                   int margin,
+                   cv::Mat* reference,
+                   cv::Mat* segmented)
+{
+    assert(rgb.size() == previousReference.size() && rgb.size() == previousSegmented.size());
+    cv::Mat changed(rgb.size(), CV_8UC1);
+    for (int y = 0; y < rgb.rows; ++y) {
+        const unsigned char* pix = rgb.ptr<unsigned char>(y);
+        const unsigned char* ref = previousReference.ptr<unsigned char>(y);
+        unsigned char* c = changed.ptr<unsigned char>(y);
+        for (int x = 0; x < rgb.cols; ++x, pix += 3, ref += 3) {
+            c[x] = ( std::abs(pix[0] - ref[0]) > changeThreshold ||
+                     std::abs(pix[1] - ref[1]) > changeThreshold ||
+                     std::abs(pix[2] - ref[2]) > changeThreshold ) ? 255 : 0;
+        }
+    }
+
+    const int changedCount = cv::countNonZero(changed);
+    if (changedCount == 0) {
+        *reference = previousReference;
+        *segmented = previousSegmented;
+
+        return;
+    }
+    if (changedCount > kTemporalMaxChangedFraction * rgb.rows * rgb.cols) {
+        // a cut or a large move: the whole frame is segmented again
+        *reference = rgb.clone();
+        segmentImage(params, rgb, segmented);
+
+        return;
+    }
+
+    std::vector<cv::Rect> regions;
+    maskRegions(changed, margin, &regions);
+    *reference = previousReference.clone();
+    *segmented = previousSegmented.clone();
+    for (std::size_t i = 0; i < regions.size(); ++i) {
+        const cv::Rect & r = regions[i];
+        cv::Mat part;
+        segmentImage(params, rgb(r), &part);
+        part.copyTo( (*segmented)(r), changed(r) );
+        rgb(r).copyTo( (*reference)(r), changed(r) );
+    }
+}
+
+/**
+ * @brief The last segmentation computed by an instance, with the input it corresponds to, so that the next frame only
+ * segments the regions that changed. The cached matrices are shared with the callers, which must not modify them.
+ **/
+class SegmentationCache
+{
+public:
+    SegmentationCache()
+    : _mutex()
+    , _valid(false)
+    , _time(0.)
+    , _params()
+    , _reference()
+    , _segmented()
+    {
+        _bounds.x1 = _bounds.y1 = _bounds.x2 = _bounds.y2 = 0;
+        _renderScale.x = _renderScale.y = 1.;
+    }
+
+    /**
+     * @brief Get the cached segmentation, if it was computed at a neighboring time (rendering forward, backward, or
+     * the same frame again), with the same bounds, render scale and parameters.
+     **/
+    bool get(double time,
+             const OfxRectI & bounds,
+             const OfxPointD & renderScale,
+             const std::vector<double> & params,
+             cv::Mat* reference,
+             cv::Mat* segmented)
+    {
+        AutoMutex l(_mutex);
+
+        if ( !_valid || (std::fabs(time - _time) > 1.) ||
+             (bounds.x1 != _bounds.x1) || (bounds.y1 != _bounds.y1) || (bounds.x2 != _bounds.x2) || (bounds.y2 != _bounds.y2) ||
+             (renderScale.x != _renderScale.x) || (renderScale.y != _renderScale.y) || (params != _params) ) {
+            return false;
+        }
+        *reference = _reference;
+        *segmented = _segmented;
+
+        return true;
+    }
+
+    void set(double time,
+             const OfxRectI & bounds,
+             const OfxPointD & renderScale,
+             const std::vector<double> & params,
+             const cv::Mat & reference,
+             const cv::Mat & segmented)
+    {
+        AutoMutex l(_mutex);
+
+        _valid = true;
+        _time = time;
+        _bounds = bounds;
+        _renderScale = renderScale;
+        _params = params;
+        _reference = reference;
+        _segmented = segmented;
+    }
+
+    void clear()
+    {
+        AutoMutex l(_mutex);
+
+        _valid = false;
+        _params.clear();
+        _reference.release();
+        _segmented.release();
+    }
+
+private:
+    Mutex _mutex;
+    bool _valid;
+    double _time;
+    OfxRectI _bounds;
+    OfxPointD _renderScale;
+    std::vector<double> _params;
+    cv::Mat _reference;
+    cv::Mat _segmented;
+};
+
+
+class SegmentPlugin
+    : public GenericOpenCVPlugin
+{
+public:
+    /** @brief ctor */
+    SegmentPlugin(OfxImageEffectHandle handle)
+    : GenericOpenCVPlugin( handle, gLutManager->sRGBLut() )
+    , _method(0)
+    , _linkThreshold(0)
+    , _clusterThreshold(0)
+    , _pyramidLevels(0)
+    , _spatialRadius(0)
+    , _colorRadius(0)
+    , _meanShiftLevels(0)
+    , _iterations(0)
+    , _regionSize(0)
+    , _ruler(0)
+    , _sigma(0)
+    , _k(0)
+    , _minSize(0)
+    , _temporal(0)
+    , _changeThreshold(0)
+    , _cache()
+    {
+        _method = fetchChoiceParam(kParamMethod);
+        _linkThreshold = fetchDoubleParam(kParamLinkThreshold);
+        _clusterThreshold = fetchDoubleParam(kParamClusterThreshold);
+        _pyramidLevels = fetchIntParam(kParamPyramidLevels);
+        _spatialRadius = fetchDoubleParam(kParamSpatialRadius);
+        _colorRadius = fetchDoubleParam(kParamColorRadius);
+        _meanShiftLevels = fetchIntParam(kParamMeanShiftLevels);
+        _iterations = fetchIntParam(kParamIterations);
+        _regionSize = fetchIntParam(kParamRegionSize);
+        _ruler = fetchDoubleParam(kParamRuler);
+        _sigma = fetchDoubleParam(kParamSigma);
+        _k = fetchDoubleParam(kParamK);
+        _minSize = fetchIntParam(kParamMinSize);
+        assert(_method && _linkThreshold && _clusterThreshold && _pyramidLevels &&
+               _spatialRadius && _colorRadius && _meanShiftLevels && _iterations &&
+               _regionSize && _ruler && _sigma && _k && _minSize);
+
+        _temporal = fetchBooleanParam(kParamTemporal);
+        _changeThreshold = fetchDoubleParam(kParamChangeThreshold);
+        assert(_temporal && _changeThreshold);
+
+        updateMethod();
+
+        bool temporal;
+        _temporal->getValue(temporal);
+        _changeThreshold->setEnabled(temporal);
+    }
+
+private:
+    /* Override the render */
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+
+    // override the roi call, since every output pixel may depend on the whole input
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    void getSegmentationParams(double time, const OfxPointD & renderScale, SegmentationParams* params);
+
+    void updateVisibility(SegmentationMethodEnum method);
+
+    void updateMethod();
+
+private:
+    ChoiceParam* _method;
+
+    // Pyramid
+    DoubleParam* _linkThreshold;
+    DoubleParam* _clusterThreshold;
+    IntParam* _pyramidLevels;
+
+    // Mean Shift
+    DoubleParam* _spatialRadius;
+    DoubleParam* _colorRadius;
+    IntParam* _meanShiftLevels;
+
+    // Mean Shift && SLIC
+    IntParam* _iterations;
+
+    // SLIC
+    IntParam* _regionSize;
+    DoubleParam* _ruler;
+
+    // Graph
+    DoubleParam* _sigma;
+    DoubleParam* _k;
+    IntParam* _minSize;
+
+    BooleanParam* _temporal;
+    DoubleParam* _changeThreshold;
+
+    // the last segmentation, for the temporal coherence
+    SegmentationCache _cache;
+};
+
+void
+SegmentPlugin::getSegmentationParams(double time,
+                                     const OfxPointD & renderScale,
+                                     SegmentationParams* params)
+{
+    int method_i;
+
+    _method->getValueAtTime(time, method_i);
+    params->method = methodFromOption(method_i);
+
+    _linkThreshold->getValueAtTime(time, params->linkThreshold);
+    _clusterThreshold->getValueAtTime(time, params->clusterThreshold);
+    _pyramidLevels->getValueAtTime(time, params->pyramidLevels);
+
+    _spatialRadius->getValueAtTime(time, params->spatialRadius);
+    _colorRadius->getValueAtTime(time, params->colorRadius);
+    _meanShiftLevels->getValueAtTime(time, params->meanShiftLevels);
+    _iterations->getValueAtTime(time, params->iterations);
+
+    _regionSize->getValueAtTime(time, params->regionSize);
+    _ruler->getValueAtTime(time, params->ruler);
+
+    _sigma->getValueAtTime(time, params->sigma);
+    _k->getValueAtTime(time, params->k);
+    _minSize->getValueAtTime(time, params->minSize);
+
+    // the sizes are in full resolution pixels
+    params->spatialRadius *= renderScale.x;
+    params->regionSize = std::max( 2, (int)(params->regionSize * renderScale.x + 0.5) );
+    params->sigma *= renderScale.x;
+    params->minSize = std::max( 1, (int)(params->minSize * renderScale.x * renderScale.y + 0.5) );
+}
+
+// the overridden render function
+void
+SegmentPlugin::render(const OFX::RenderArguments &args)
+{
+    std::auto_ptr<OFX::Image> dst( _dstClip->fetchImage(args.time) );
+
+    if ( !dst.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if ( (dst->getRenderScale().x != args.renderScale.x) ||
+         ( dst->getRenderScale().y != args.renderScale.y) ||
+         ( dst->getField() != args.fieldToRender) ) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    std::auto_ptr<const OFX::Image> src( (_srcClip && _srcClip->isConnected()) ?
+                                         _srcClip->fetchImage(args.time) : 0 );
+    if ( !src.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    const OfxRectI & bounds = src->getBounds();
+    if ( (args.renderWindow.x1 < bounds.x1) || (bounds.x2 < args.renderWindow.x2) ||
+         (args.renderWindow.y1 < bounds.y1) || (bounds.y2 < args.renderWindow.y2) ) {
+        // the host did not give the region we asked for in getRegionsOfInterest
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    SegmentationParams params;
+    getSegmentationParams(args.time, args.renderScale, &params);
+    if ( !isMethodAvailable(params.method) ) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "The selected method was not available when the plugin was compiled");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    bool temporal;
+    _temporal->getValueAtTime(args.time, temporal);
+
+    // the whole input is segmented
+    CVImageWrapper rgbImg;
+    fetchCVImage8U(src.get(), bounds, true, &rgbImg, ePixelComponentRGB, 3);
+#if CV_MAJOR_VERSION >= 3
+    cv::Mat rgb = *rgbImg.getCvMat();
+#else
+    cv::Mat rgb(rgbImg.getIplImage(), false /*copyData*/);
+#endif
+
+    cv::Mat segmented;
+    if (temporal) {
+        double changeThreshold;
+        _changeThreshold->getValueAtTime(args.time, changeThreshold);
+        std::vector<double> paramsValues;
+        segmentationParamsValues(params, &paramsValues);
+
+        cv::Mat previousReference, previousSegmented, reference;
+        if ( _cache.get(args.time, bounds, args.renderScale, paramsValues, &previousReference, &previousSegmented) ) {
+            updateSegmentation( params, rgb, previousReference, previousSegmented, changeThreshold,
+                                (int)std::ceil(kTemporalMargin * args.renderScale.x), &reference, &segmented );
+        } else {
+            // the wrapper's buffer is released at the end of the render
+            reference = rgb.clone();
+            segmentImage(params, rgb, &segmented);
+        }
+        _cache.set(args.time, bounds, args.renderScale, paramsValues, reference, segmented);
+    } else {
+        segmentImage(params, rgb, &segmented);
+    }
+
+    // the render window of the segmented image
+    const cv::Mat window = segmented( cv::Rect(args.renderWindow.x1 - bounds.x1, args.renderWindow.y1 - bounds.y1,
+                                               args.renderWindow.x2 - args.renderWindow.x1, args.renderWindow.y2 - args.renderWindow.y1) );
+    CVImageWrapper windowImg;
+    windowImg.initializeView(window.data, args.renderWindow, 3, (unsigned int)window.step[0], eBitDepthUByte);
+    cvImageToOfxImage( windowImg, args.renderWindow, dst.get() );
+} // render
+
+void
+SegmentPlugin::purgeCaches()
+{
+    _cache.clear();
+    GenericOpenCVPlugin::purgeCaches();
+}
+
+void
+SegmentPlugin::updateVisibility(SegmentationMethodEnum method)
+{
+    _linkThreshold->setIsSecret(method != eSegmentationPyramid);
+    _clusterThreshold->setIsSecret(method != eSegmentationPyramid);
+    _pyramidLevels->setIsSecret(method != eSegmentationPyramid);
+
+    _spatialRadius->setIsSecret(method != eSegmentationMeanShift);
+    _colorRadius->setIsSecret(method != eSegmentationMeanShift);
+    _meanShiftLevels->setIsSecret(method != eSegmentationMeanShift);
+
+    _iterations->setIsSecret(method != eSegmentationMeanShift && method != eSegmentationSLIC);
+
+    _regionSize->setIsSecret(method != eSegmentationSLIC);
+    _ruler->setIsSecret(method != eSegmentationSLIC);
+
+    _sigma->setIsSecret(method != eSegmentationGraph);
+    _k->setIsSecret(method != eSegmentationGraph);
+    _minSize->setIsSecret(method != eSegmentationGraph);
+}
+
+// show the params of the selected method, and report the methods that were not compiled
+void
+SegmentPlugin::updateMethod()
+{
+    int method_i;
+
+    _method->getValue(method_i);
+    const SegmentationMethodEnum method = methodFromOption(method_i);
+    updateVisibility(method);
+    if ( isMethodAvailable(method) ) {
+        clearPersistentMessage();
+    } else {
+        setPersistentMessage(OFX::Message::eMessageError, "", "The selected method was not available when the plugin was compiled");
+    }
+}
+
+void
+SegmentPlugin::changedParam(const InstanceChangedArgs & /*args*/,
+                            const std::string &paramName)
+{
+    if (paramName == kParamMethod) {
+        updateMethod();
+    } else if (paramName == kParamTemporal) {
+        bool temporal;
+        _temporal->getValue(temporal);
+        _changeThreshold->setEnabled(temporal);
+    }
+}
+
+void
+SegmentPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                    OFX::RegionOfInterestSetter &rois)
+{
+    if (!_srcClip) {
+        return;
+    }
+    rois.setRegionOfInterest( *_srcClip, _srcClip->getRegionOfDefinition(args.time) );
+}
+
+mDeclarePluginFactory(SegmentPluginFactory,  { gLutManager = new OFX::Color::LutManager<Mutex>; }, { delete gLutManager; });
+
+using namespace OFX;
+void
+SegmentPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
+{
+    genericCVDescribe(kPluginName, kPluginGrouping, kPluginDescription, kSupportsTiles, kSupportsMultiResolution, false, kRenderThreadSafety, desc);
+    // the segmentation works on 8-bit pixels, so 8-bit images are segmented in place, without a conversion
+    desc.addSupportedBitDepth(eBitDepthUByte);
+}
+
+void
+SegmentPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
+                                        OFX::ContextEnum context)
+{
+    // Source clip only in the filter context
+    // create the mandated source clip
+    ClipDescriptor *srcClip = desc.defineClip(kOfxImageEffectSimpleSourceClipName);
+
+    srcClip->addSupportedComponent(ePixelComponentRGBA);
+    srcClip->addSupportedComponent(ePixelComponentRGB);
+    srcClip->setTemporalClipAccess(false);
+    srcClip->setSupportsTiles(kSupportsTiles);
+    srcClip->setIsMask(false);
+
+    // create the mandated output clip
+    ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
+    dstClip->addSupportedComponent(ePixelComponentRGBA);
+    dstClip->addSupportedComponent(ePixelComponentRGB);
+    dstClip->setSupportsTiles(kSupportsTiles);
+
+
+    // make some pages and to things in
+    PageParamDescriptor *page = desc.definePageParam("Controls");
+
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamMethod);
+        param->setLabels(kParamMethodLabel, kParamMethodLabel, kParamMethodLabel);
+        param->setHint(kParamMethodHint);
+        // in the order of SegmentationMethodEnum
+        param->appendOption(kParamMethodOptionPyramid, kParamMethodOptionPyramidHint);
+        param->appendOption(kParamMethodOptionMeanShift, kParamMethodOptionMeanShiftHint);
+        param->appendOption(kParamMethodOptionSLIC, kParamMethodOptionSLICHint);
+        param->appendOption(kParamMethodOptionGraph, kParamMethodOptionGraphHint);
+        // the pyramid of the original plugin when it is available
+        param->setDefault( (int)kParamMethodDefault );
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamLinkThreshold);
+        param->setLabels(kParamLinkThresholdLabel, kParamLinkThresholdLabel, kParamLinkThresholdLabel);
+        param->setHint(kParamLinkThresholdHint);
+        param->setRange(0., 255.);
+        param->setDisplayRange(1., 255.);
+        param->setDefault(250.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamClusterThreshold);
+        param->setLabels(kParamClusterThresholdLabel, kParamClusterThresholdLabel, kParamClusterThresholdLabel);
+        param->setHint(kParamClusterThresholdHint);
+        param->setRange(0., 255.);
+        param->setDisplayRange(1., 255.);
+        param->setDefault(30.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamPyramidLevels);
+        param->setLabels(kParamPyramidLevelsLabel, kParamPyramidLevelsLabel, kParamPyramidLevelsLabel);
+        param->setHint(kParamPyramidLevelsHint);
+        param->setRange(1, 6);
+        param->setDisplayRange(1, 6);
+        param->setDefault(2);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamSpatialRadius);
+        param->setLabels(kParamSpatialRadiusLabel, kParamSpatialRadiusLabel, kParamSpatialRadiusLabel);
+        param->setHint(kParamSpatialRadiusHint);
+        param->setRange(1., 100.);
+        param->setDisplayRange(1., 32.);
+        param->setDefault(8.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamColorRadius);
+        param->setLabels(kParamColorRadiusLabel, kParamColorRadiusLabel, kParamColorRadiusLabel);
+        param->setHint(kParamColorRadiusHint);
+        param->setRange(1., 255.);
+        param->setDisplayRange(1., 100.);
+        param->setDefault(30.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamMeanShiftLevels);
+        param->setLabels(kParamMeanShiftLevelsLabel, kParamMeanShiftLevelsLabel, kParamMeanShiftLevelsLabel);
+        param->setHint(kParamMeanShiftLevelsHint);
+        param->setRange(0, 4);
+        param->setDisplayRange(0, 4);
+        param->setDefault(1);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamIterations);
+        param->setLabels(kParamIterationsLabel, kParamIterationsLabel, kParamIterationsLabel);
+        param->setHint(kParamIterationsHint);
+        param->setRange(1, 100);
+        param->setDisplayRange(1, 20);
+        param->setDefault(5);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamRegionSize);
+        param->setLabels(kParamRegionSizeLabel, kParamRegionSizeLabel, kParamRegionSizeLabel);
+        param->setHint(kParamRegionSizeHint);
+        param->setRange(2, 1000);
+        param->setDisplayRange(4, 100);
+        param->setDefault(20);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamRuler);
+        param->setLabels(kParamRulerLabel, kParamRulerLabel, kParamRulerLabel);
+        param->setHint(kParamRulerHint);
+        param->setRange(0., 100.);
+        param->setDisplayRange(1., 40.);
+        param->setDefault(10.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamSigma);
+        param->setLabels(kParamSigmaLabel, kParamSigmaLabel, kParamSigmaLabel);
+        param->setHint(kParamSigmaHint);
+        param->setRange(0., 10.);
+        param->setDisplayRange(0., 2.);
+        param->setDefault(0.5);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamK);
+        param->setLabels(kParamKLabel, kParamKLabel, kParamKLabel);
+        param->setHint(kParamKHint);
+        param->setRange(1., 100000.);
+        param->setDisplayRange(10., 2000.);
+        param->setDefault(300.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamMinSize);
+        param->setLabels(kParamMinSizeLabel, kParamMinSizeLabel, kParamMinSizeLabel);
+        param->setHint(kParamMinSizeHint);
+        param->setRange(1, 100000);
+        param->setDisplayRange(1, 1000);
+        param->setDefault(100);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamTemporal);
+        param->setLabels(kParamTemporalLabel, kParamTemporalLabel, kParamTemporalLabel);
+        param->setHint(kParamTemporalHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamChangeThreshold);
+        param->setLabels(kParamChangeThresholdLabel, kParamChangeThresholdLabel, kParamChangeThresholdLabel);
+        param->setHint(kParamChangeThresholdHint);
+        param->setRange(0., 255.);
+        param->setDisplayRange(0., 32.);
+        param->setDefault(8.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+} // describeInContext
+
+OFX::ImageEffect*
+SegmentPluginFactory::createInstance(OfxImageEffectHandle handle,
+                                     OFX::ContextEnum /*context*/)
+{
+    return new SegmentPlugin(handle);
+}
+
+static SegmentPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+mRegisterPluginFactoryInstance(p)
+
+OFXS_NAMESPACE_ANONYMOUS_EXIT;
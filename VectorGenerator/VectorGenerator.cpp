@@ -75,6 +75,7 @@
 #include "GenericOpenCVPlugin.h"
 
 #include <ofxsLut.h>
+#include "ofxsPixelProcessor.h"
 //#include <ofxsCopier.h>
 
 #if CV_MAJOR_VERSION >= 3
@@ -83,10 +84,54 @@
 #if CV_MAJOR_VERSION >= 4
 #include <opencv2/core/types_c.h>
 #endif
+// the optflow module of opencv_contrib, which may not be installed
+#include <opencv2/opencv_modules.hpp>
+#ifdef HAVE_OPENCV_OPTFLOW
+#include <opencv2/optflow.hpp>
+#endif
 #else
 #define VECTOR_GENERATOR_WITH_SIMPLE_FLOW
 #endif
 
+#if CV_MAJOR_VERSION >= 4 && defined(HAVE_OPENCV_OPTFLOW)
+// the Dual TV L1 of OpenCV 3 moved to the optflow module in OpenCV 4
+#define VECTOR_GENERATOR_WITH_TVL1_OPTFLOW
+#endif
+
+#if CV_MAJOR_VERSION < 4 || defined(VECTOR_GENERATOR_WITH_TVL1_OPTFLOW)
+#define VECTOR_GENERATOR_WITH_TVL1_INITIAL_FLOW
+#define VECTOR_GENERATOR_WITH_TVL1_FLOAT
+#else
+// without opencv_contrib, the Dual TV L1 of OpenCV 4 comes from the superres module, whose wrapper keeps its own flow buffer
+// and converts its inputs to 8 bits
+#endif
+
+#if CV_MAJOR_VERSION >= 4
+// DIS is in the video module since OpenCV 4
+#define VECTOR_GENERATOR_WITH_DIS_FLOW
+#elif CV_MAJOR_VERSION == 3 && defined(HAVE_OPENCV_OPTFLOW)
+// DIS is in the optflow module of opencv_contrib in OpenCV 3
+#define VECTOR_GENERATOR_WITH_DIS_FLOW
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VECTOR_GENERATOR_WITH_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
 using namespace OFX;
 using namespace cv;
 #if CV_MAJOR_VERSION >= 4
@@ -95,6 +140,15 @@ using namespace cv::superres;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER;
 
+// declared in this namespace so that they are not ambiguous with cv::Mutex
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
 #define kPluginName "VectorGeneratorOFX"
 #define kPluginGrouping "Time"
 #define kPluginDescription "Compute optical flow for the input sequence, using OpenCV."
@@ -102,7 +156,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER;
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0
+#define kSupportsTiles 1
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -138,7 +192,36 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER;
 
 #define kParamMethod "method"
 #define kParamMethodLabel "Method"
-#define kParamMethodHint ""
+#define kParamMethodHint "Optical flow algorithm. Simple flow requires OpenCV 2, DIS requires OpenCV 4 or the optflow module of " \
+    "opencv_contrib: a method that was not available when the plugin was compiled renders an error."
+
+#define kParamFlowQuality "flowQuality"
+#define kParamFlowQualityLabel "Flow Quality"
+#define kParamFlowQualityHint "Resolution, relative to the full resolution of the input, at which the flow is computed. The flow is then upsampled " \
+    "to the render resolution. If the host already renders at a lower resolution, the flow is never computed at more than the render resolution."
+#define kParamFlowQualityOptionFull "Full"
+#define kParamFlowQualityOptionFullHint "Compute the flow at full resolution."
+#define kParamFlowQualityOptionHalf "Half"
+#define kParamFlowQualityOptionHalfHint "Compute the flow at 1/2 resolution."
+#define kParamFlowQualityOptionQuarter "Quarter"
+#define kParamFlowQualityOptionQuarterHint "Compute the flow at 1/4 resolution."
+#define kParamFlowQualityOptionEighth "Eighth"
+#define kParamFlowQualityOptionEighthHint "Compute the flow at 1/8 resolution."
+
+#define kParamWorkingSpace "workingSpace"
+#define kParamWorkingSpaceLabel "Working Space"
+#ifdef VECTOR_GENERATOR_WITH_TVL1_FLOAT
+#define kParamWorkingSpaceHint "Encoding of the luminance on which the flow is computed. Simple flow always works on 8-bit sRGB colors, and DIS on 8-bit sRGB luminance."
+#else
+#define kParamWorkingSpaceHint "Encoding of the luminance on which the flow is computed. Simple flow always works on 8-bit sRGB colors, and DIS on 8-bit sRGB luminance. " \
+    "Dual TV L1 also works on 8-bit sRGB luminance, because the optflow module of opencv_contrib was not available when the plugin was compiled."
+#endif
+#define kParamWorkingSpaceOptionSRGB8 "sRGB 8-bit"
+#define kParamWorkingSpaceOptionSRGB8Hint "The input is converted to 8-bit sRGB, which quantizes the shadows."
+#define kParamWorkingSpaceOptionLinear "Linear"
+#define kParamWorkingSpaceOptionLinearHint "The linear float luminance of the input is used directly."
+#define kParamWorkingSpaceOptionLog "Log"
+#define kParamWorkingSpaceOptionLogHint "The float luminance of the input is log-encoded, which gives as much weight to each stop, and helps on dark plates."
 
 #define kParamAdvanced "advanced"
 #define kParamAdvancedLabel "Advanced"
@@ -215,15 +298,1501 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER;
 #define kParamEpsilonLabel "Epsilon"
 #define kParamEpsilonHint "Stopping criterion theshold which is a trade-off between accuracy and running time. A small value will yield more accurate solutions."
 
+//DIS
+#define kParamDISPreset "disPreset"
+#define kParamDISPresetLabel "Preset"
+#define kParamDISPresetHint "Speed/quality tradeoff of the DIS method. Selecting a preset also sets the Patch Size and Patch Stride to its values."
+#define kParamDISPresetOptionUltrafast "Ultrafast"
+#define kParamDISPresetOptionUltrafastHint "Fastest, for interactive previews. No variational refinement."
+#define kParamDISPresetOptionFast "Fast"
+#define kParamDISPresetOptionFastHint "Fast, with a few variational refinement iterations."
+#define kParamDISPresetOptionMedium "Medium"
+#define kParamDISPresetOptionMediumHint "Slower but more accurate, computed down to the full resolution."
+
+//DIS
+#define kParamPatchSize "patchSize"
+#define kParamPatchSizeLabel "Patch Size"
+#define kParamPatchSizeHint "Size of the patches that are matched between the frames. Larger patches are more robust, but blur the motion boundaries."
+
+//DIS
+#define kParamPatchStride "patchStride"
+#define kParamPatchStrideLabel "Patch Stride"
+#define kParamPatchStrideHint "Distance between neighboring patches. Smaller strides are more accurate but slower. It is at most the Patch Size."
+
+#define kParamWarmStart "warmStart"
+#define kParamWarmStartLabel "Warm Start"
+#define kParamWarmStartHint "When the frames are rendered forward in sequence, the flow is solved starting from the flow of the previous frame rather than " \
+    "from zero. On smooth motion, fewer warps and iterations are then needed, but the result depends on the order in which the frames are " \
+    "rendered. Only used by Farneback and Dual TV L1."
+
+//Farneback
+#define kParamWarmLevels "warmLevels"
+#define kParamWarmLevelsLabel "Warm Levels"
+#define kParamWarmLevelsHint "Number of pyramid levels used instead of Levels when the solver starts from the flow of the previous frame. " \
+    "That flow already holds the large displacements, so fewer levels are needed. It is never more than Levels."
+
+//Farneback
+#define kParamWarmIterations "warmIterations"
+#define kParamWarmIterationsLabel "Warm Iterations"
+#define kParamWarmIterationsHint "Number of iterations used instead of Iterations when the solver starts from the flow of the previous frame. " \
+    "It is never more than Iterations."
+
+#define kParamDeriveBackward "deriveBackward"
+#define kParamDeriveBackwardLabel "Derive Backward Flow"
+#define kParamDeriveBackwardHint "If the forward flow from the previous frame to the current frame was already computed, the backward flow is obtained by " \
+    "inverting it instead of solving it again. This nearly halves the time of sequential renders, but is less accurate in occluded areas."
+
+#define kParamPrefetch "prefetch"
+#define kParamPrefetchLabel "Prefetch Next Frame"
+#define kParamPrefetchHint "Fetch the source frame that only the render of the next frame needs, and convert it on another thread while the " \
+    "flow is solved. Only the conversion overlaps the solve: the host reads the frame before the render, as for any other input. " \
+    "Only used when there are more CPUs than flows to solve, and then asks the host for one more frame."
+
+// maximum amount of memory used by the flow cache of each instance
+#define kFlowCacheMaxBytes (512 * 1024 * 1024)
+
+// maximum amount of memory used by the warm start flows of each instance
+#define kFlowSeedsMaxBytes (128 * 1024 * 1024)
+
+// maximum amount of memory used by the converted source frames of each instance
+#define kFrameCacheMaxBytes (256 * 1024 * 1024)
+
+// maximum number of proxies kept for each converted source frame
+#define kFrameCacheMaxProxies 4
+
+// maximum number of idle Dual TV L1 solvers kept by each instance, each one holds buffers the size of its last images
+#define kDualTVL1PoolMaxIdle 4
+
+// number of fixed-point iterations used to invert a flow field
+#define kInvertFlowIterations 4
 
+// fixed Farneback parameters
+#define kFarnebackPyrScale 0.5
+#define kFarnebackWinSize 3
 
+// the Dual TV L1 regularization is global, this is the support considered at its coarsest scale
+#define kDualTVL1HaloBase 16
+
+// the support of DIS is its patch size at this many levels above the finest pyramid level
+#define kDISHaloLevels 3
+
+// maximum margin, in pixels, computed around a tile
+#define kFlowHaloMax 512
+
+// the flow is never computed on images smaller than this
+#define kFlowProxyMinSize 16
+
+
+// the order of the options of the method choice param, which does not depend on the compiled methods so that projects stay portable
 enum OpticalFlowMethodEnum
 {
     eOpticalFlowFarneback = 0,
     eOpticalFlowSimpleFlow,
-    eOpticalFlowDualTVL1
+    eOpticalFlowDualTVL1,
+    eOpticalFlowDIS
+};
+
+static OpticalFlowMethodEnum
+methodFromOption(int option)
+{
+    if ( (option < (int)eOpticalFlowFarneback) || (option > (int)eOpticalFlowDIS) ) {
+        return eOpticalFlowFarneback;
+    }
+
+    return (OpticalFlowMethodEnum)option;
+}
+
+// whether the method was available when the plugin was compiled
+static bool
+isMethodAvailable(OpticalFlowMethodEnum method)
+{
+    switch (method) {
+    case eOpticalFlowFarneback:
+    case eOpticalFlowDualTVL1:
+        return true;
+    case eOpticalFlowSimpleFlow:
+#ifdef VECTOR_GENERATOR_WITH_SIMPLE_FLOW
+        return true;
+#else
+        return false;
+#endif
+    case eOpticalFlowDIS:
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+// the presets of the DIS method, in the same order as the presets of OpenCV
+enum DISPresetEnum
+{
+    eDISPresetUltrafast = 0,
+    eDISPresetFast,
+    eDISPresetMedium
+};
+
+// the patch size and stride set by each preset of OpenCV
+static const int gDISPresetPatchSize[] = { 8, 8, 12 };
+static const int gDISPresetPatchStride[] = { 4, 4, 3 };
+
+// the resolution at which the flow is computed, each option halves the previous one
+enum FlowQualityEnum
+{
+    eFlowQualityFull = 0,
+    eFlowQualityHalf,
+    eFlowQualityQuarter,
+    eFlowQualityEighth
+};
+
+// the options of the working space parameter
+enum WorkingSpaceEnum
+{
+    eWorkingSpaceSRGB8 = 0,
+    eWorkingSpaceLinear,
+    eWorkingSpaceLog
+};
+
+// the options of the R/G/B/A channel parameters
+enum ChannelEnum
+{
+    eChannelNone = 0,
+    eChannelForwardU,
+    eChannelForwardV,
+    eChannelBackwardU,
+    eChannelBackwardV
+};
+
+// the assignments of the R/G/B/A channels that have a specialized writer
+enum FlowLayoutEnum
+{
+    eFlowLayoutGeneric = 0, // any assignment
+    eFlowLayoutForwardBackward, // forward.u, forward.v, backward.u, backward.v
+    eFlowLayoutForward, // forward.u, forward.v, 0, 0
+    eFlowLayoutBackward // backward.u, backward.v, 0, 0
+};
+
+// the values of the parameters used to compute the flow at a given time
+struct OpticalFlowParams
+{
+    OpticalFlowMethodEnum method;
+
+    // number of times the input is halved before computing the flow, from the flow quality and the render scale
+    int proxyLevel;
+
+    WorkingSpaceEnum workingSpace;
+
+    //Farneback
+    int levels;
+
+    //Farneback + DUAL TV L1
+    int iterations;
+
+    //Farneback
+    int neighborhood;
+    double sigma;
+
+    //Simple flow
+    int layers;
+    int blockSize;
+    int maxFlow;
+
+    //Dual TV L1
+    double tau;
+    double lambda;
+    double theta;
+    int nScales;
+    int warps;
+    double epsilon;
+
+    //DIS
+    DISPresetEnum disPreset;
+    int patchSize;
+    int patchStride;
+
+    // start from the flow of the previous frame, if the method supports it
+    bool warmStart;
+
+    //Farneback, when starting from the flow of the previous frame
+    int warmLevels;
+    int warmIterations;
+};
+
+// the values of the parameters that the method uses, to tell whether two flows were computed with the same parameters
+static void
+opticalFlowParamsValues(const OpticalFlowParams & params,
+                        std::vector<double>* values)
+{
+    values->clear();
+    values->push_back( (double)params.method );
+    values->push_back(params.proxyLevel);
+    values->push_back( (double)params.workingSpace );
+    values->push_back(params.warmStart ? 1. : 0.);
+    switch (params.method) {
+    case eOpticalFlowFarneback:
+        values->push_back(params.levels);
+        values->push_back(params.iterations);
+        values->push_back(params.neighborhood);
+        values->push_back(params.sigma);
+        if (params.warmStart) {
+            values->push_back(params.warmLevels);
+            values->push_back(params.warmIterations);
+        }
+        break;
+    case eOpticalFlowSimpleFlow:
+        values->push_back(params.layers);
+        values->push_back(params.blockSize);
+        values->push_back(params.maxFlow);
+        break;
+    case eOpticalFlowDualTVL1:
+        values->push_back(params.iterations);
+        values->push_back(params.tau);
+        values->push_back(params.lambda);
+        values->push_back(params.theta);
+        values->push_back(params.nScales);
+        values->push_back(params.warps);
+        values->push_back(params.epsilon);
+        break;
+    case eOpticalFlowDIS:
+        values->push_back( (double)params.disPreset );
+        values->push_back(params.patchSize);
+        values->push_back(params.patchStride);
+        break;
+    }
+}
+
+// true if the method can start from an initial flow
+static bool
+supportsInitialFlow(OpticalFlowMethodEnum method)
+{
+#ifdef VECTOR_GENERATOR_WITH_TVL1_INITIAL_FLOW
+    const bool tvl1InitialFlow = true;
+#else
+    const bool tvl1InitialFlow = false;
+#endif
+
+    return method == eOpticalFlowFarneback || (method == eOpticalFlowDualTVL1 && tvl1InitialFlow);
+}
+
+// true if the method works on float images, and so can use the Linear and Log working spaces
+static bool
+supportsFloatInput(OpticalFlowMethodEnum method)
+{
+#ifdef VECTOR_GENERATOR_WITH_TVL1_FLOAT
+    const bool tvl1Float = true;
+#else
+    const bool tvl1Float = false;
+#endif
+
+    // Simple flow only takes 8-bit color images, and DIS 8-bit grayscale images
+    return method == eOpticalFlowFarneback || (method == eOpticalFlowDualTVL1 && tvl1Float);
+}
+
+static std::size_t
+matBytes(const cv::Mat & m)
+{
+    return m.total() * m.elemSize();
+}
+
+/**
+ * @brief A thread-safe cache of values, bounded in bytes. When the cache is full, the least recently used values are
+ * evicted first. The values are copied in and out, so that the cv::Mat they hold share their data with the callers,
+ * which must not modify them.
+ **/
+template <class Key, class Value>
+class LRUCache
+{
+public:
+    explicit LRUCache(std::size_t maxBytes)
+    : _mutex()
+    , _entries()
+    , _order()
+    , _bytes(0)
+    , _maxBytes(maxBytes)
+    {
+    }
+
+    bool get(const Key & key,
+             Value* value)
+    {
+        AutoMutex l(_mutex);
+        typename EntryMap::iterator it = _entries.find(key);
+
+        if ( it == _entries.end() ) {
+            return false;
+        }
+        touch(it);
+        *value = it->second.value;
+
+        return true;
+    }
+
+    // replace the value of key, which takes the given bytes. A value larger than the whole cache is not cached.
+    void insert(const Key & key,
+                const Value & value,
+                std::size_t bytes)
+    {
+        if (bytes > _maxBytes) {
+            return;
+        }
+        AutoMutex l(_mutex);
+        typename EntryMap::iterator it = _entries.find(key);
+        if ( it != _entries.end() ) {
+            erase(it);
+        }
+        while (_bytes + bytes > _maxBytes) {
+            erase( _entries.find( _order.back() ) );
+        }
+        _order.push_front(key);
+        Entry & e = _entries[key];
+        e.value = value;
+        e.bytes = bytes;
+        e.position = _order.begin();
+        _bytes += bytes;
+    }
+
+    /**
+     * @brief If key is cached, call visitor(value, &bytes) on its value with the cache locked. The visitor may modify
+     * the value and its size, and returns true if it used the value, which is then the most recently used. The least
+     * recently used values are then evicted until the cache fits in its bounds again.
+     **/
+    template <class Visitor>
+    bool visit(const Key & key,
+               Visitor & visitor)
+    {
+        AutoMutex l(_mutex);
+        typename EntryMap::iterator it = _entries.find(key);
+
+        if ( it == _entries.end() ) {
+            return false;
+        }
+        std::size_t bytes = it->second.bytes;
+        const bool used = visitor(it->second.value, &bytes);
+        _bytes = _bytes - it->second.bytes + bytes;
+        it->second.bytes = bytes;
+        if (used) {
+            touch(it);
+        }
+        while (_bytes > _maxBytes) {
+            erase( _entries.find( _order.back() ) );
+        }
+
+        return used;
+    }
+
+    void clear()
+    {
+        AutoMutex l(_mutex);
+
+        _entries.clear();
+        _order.clear();
+        _bytes = 0;
+    }
+
+private:
+    // the keys, from the most recently used to the least recently used
+    typedef std::list<Key> KeyList;
+
+    struct Entry
+    {
+        Value value;
+        std::size_t bytes;
+        typename KeyList::iterator position; // in _order
+    };
+
+    typedef std::map<Key, Entry> EntryMap;
+
+    // must be called with _mutex locked
+    void touch(typename EntryMap::iterator it)
+    {
+        _order.splice(_order.begin(), _order, it->second.position);
+    }
+
+    // must be called with _mutex locked
+    void erase(typename EntryMap::iterator it)
+    {
+        assert( it != _entries.end() );
+        _bytes -= it->second.bytes;
+        _order.erase(it->second.position);
+        _entries.erase(it);
+    }
+
+    Mutex _mutex;
+    EntryMap _entries;
+    KeyList _order;
+    std::size_t _bytes;
+    std::size_t _maxBytes;
+};
+
+/**
+ * @brief Identifies a flow field: the two source images it was computed from, the bounds and render scale
+ * it was computed at, and the method together with the values of the parameters that this method uses.
+ * A warm-started flow also depends on the frames rendered before it, so only flows solved from zero are keyed.
+ **/
+struct FlowCacheKey
+{
+    std::string refId;
+    std::string otherId;
+    OfxRectI bounds;
+    OfxPointD renderScale;
+    std::vector<double> params;
+
+    bool operator<(const FlowCacheKey & other) const
+    {
+        if (refId != other.refId) {
+            return refId < other.refId;
+        }
+        if (otherId != other.otherId) {
+            return otherId < other.otherId;
+        }
+        if (bounds.x1 != other.bounds.x1) {
+            return bounds.x1 < other.bounds.x1;
+        }
+        if (bounds.y1 != other.bounds.y1) {
+            return bounds.y1 < other.bounds.y1;
+        }
+        if (bounds.x2 != other.bounds.x2) {
+            return bounds.x2 < other.bounds.x2;
+        }
+        if (bounds.y2 != other.bounds.y2) {
+            return bounds.y2 < other.bounds.y2;
+        }
+        if (renderScale.x != other.renderScale.x) {
+            return renderScale.x < other.renderScale.x;
+        }
+        if (renderScale.y != other.renderScale.y) {
+            return renderScale.y < other.renderScale.y;
+        }
+
+        return params < other.params;
+    }
+};
+
+// the CV_32FC2 flow fields solved from zero
+typedef LRUCache<FlowCacheKey, cv::Mat> FlowCache;
+
+/**
+ * @brief Identifies the flow fields that can seed each other: solved in the same direction, on the same bounds, at the
+ * same render scale and with the same parameters, from consecutive reference frames.
+ **/
+struct FlowSeedKey
+{
+    int direction; // 1 for the flow to the next frame, -1 for the flow to the previous frame
+    OfxRectI bounds;
+    OfxPointD renderScale;
+    std::vector<double> params;
+
+    bool operator<(const FlowSeedKey & other) const
+    {
+        if (direction != other.direction) {
+            return direction < other.direction;
+        }
+        if (bounds.x1 != other.bounds.x1) {
+            return bounds.x1 < other.bounds.x1;
+        }
+        if (bounds.y1 != other.bounds.y1) {
+            return bounds.y1 < other.bounds.y1;
+        }
+        if (bounds.x2 != other.bounds.x2) {
+            return bounds.x2 < other.bounds.x2;
+        }
+        if (bounds.y2 != other.bounds.y2) {
+            return bounds.y2 < other.bounds.y2;
+        }
+        if (renderScale.x != other.renderScale.x) {
+            return renderScale.x < other.renderScale.x;
+        }
+        if (renderScale.y != other.renderScale.y) {
+            return renderScale.y < other.renderScale.y;
+        }
+
+        return params < other.params;
+    }
+};
+
+// a flow field at the resolution of the solver, with the time of its reference frame
+struct FlowSeed
+{
+    double time;
+    cv::Mat flow;
+};
+
+/**
+ * @brief The last flow field solved for each FlowSeedKey, at the resolution of the solver, used as the initial flow of
+ * the next frame.
+ **/
+class FlowSeeds
+{
+public:
+    explicit FlowSeeds(std::size_t maxBytes)
+    : _seeds(maxBytes)
+    {
+    }
+
+    /**
+     * @brief Get the seed of a flow whose reference frame is at the given time. Only the flow solved at the previous
+     * frame qualifies: when rendering backward or after a jump in time, the flow is solved from zero.
+     **/
+    bool get(const FlowSeedKey & key,
+             double time,
+             cv::Mat* flow)
+    {
+        FlowSeed seed;
+
+        if ( !_seeds.get(key, &seed) || (seed.time != time - 1.) ) {
+            return false;
+        }
+        *flow = seed.flow;
+
+        return true;
+    }
+
+    // replace the seed of key
+    void insert(const FlowSeedKey & key,
+                double time,
+                const cv::Mat & flow)
+    {
+        FlowSeed seed;
+
+        seed.time = time;
+        seed.flow = flow;
+        _seeds.insert( key, seed, matBytes(flow) );
+    }
+
+    void clear()
+    {
+        _seeds.clear();
+    }
+
+private:
+    LRUCache<FlowSeedKey, FlowSeed> _seeds;
+};
+
+/**
+ * @brief Approximate the flow from 'other' to 'ref', given the flow from 'ref' to 'other'.
+ * The inverse flow b verifies b(q) = -f(q + b(q)), which is solved by fixed-point iteration starting from b = -f.
+ **/
+static void
+invertFlow(const cv::Mat & forward,
+           cv::Mat* backward)
+{
+    assert(forward.type() == CV_32FC2);
+    cv::Mat map(forward.size(), CV_32FC2);
+    cv::Mat warped;
+
+    forward.convertTo(*backward, -1, -1.);
+    for (int i = 0; i < kInvertFlowIterations; ++i) {
+        for (int y = 0; y < forward.rows; ++y) {
+            const cv::Point2f* b = backward->ptr<cv::Point2f>(y);
+            cv::Point2f* m = map.ptr<cv::Point2f>(y);
+            for (int x = 0; x < forward.cols; ++x) {
+                m[x].x = x + b[x].x;
+                m[x].y = y + b[x].y;
+            }
+        }
+        remap(forward, warped, map, cv::Mat(), INTER_LINEAR, BORDER_REPLICATE);
+        warped.convertTo(*backward, -1, -1.);
+    }
+}
+
+static void
+intersectRects(const OfxRectI & a,
+               const OfxRectI & b,
+               OfxRectI* r)
+{
+    r->x1 = std::max(a.x1, b.x1);
+    r->x2 = std::max( r->x1, std::min(a.x2, b.x2) );
+    r->y1 = std::max(a.y1, b.y1);
+    r->y2 = std::max( r->y1, std::min(a.y2, b.y2) );
+}
+
+static void
+unionRects(const OfxRectI & a,
+           const OfxRectI & b,
+           OfxRectI* r)
+{
+    r->x1 = std::min(a.x1, b.x1);
+    r->x2 = std::max(a.x2, b.x2);
+    r->y1 = std::min(a.y1, b.y1);
+    r->y2 = std::max(a.y2, b.y2);
+}
+
+static bool
+equalRects(const OfxRectI & a,
+           const OfxRectI & b)
+{
+    return a.x1 == b.x1 && a.x2 == b.x2 && a.y1 == b.y1 && a.y2 == b.y2;
+}
+
+static cv::Size
+rectSize(const OfxRectI & r)
+{
+    return cv::Size(r.x2 - r.x1, r.y2 - r.y1);
+}
+
+// the pixel formats in which the flow methods take their input
+enum FlowInputFormatEnum
+{
+    eFlowInputRGB8 = 0,
+    eFlowInputGray8,
+    eFlowInputGray32Linear,
+    eFlowInputGray32Log
+};
+
+/**
+ * @brief Identifies a source frame converted to the input of the flow methods.
+ **/
+struct FrameCacheKey
+{
+    std::string clip;
+    double time;
+    OfxPointD renderScale;
+    FlowInputFormatEnum format;
+    std::string imageId; // the frame is converted again if the host gives another image
+
+    bool operator<(const FrameCacheKey & other) const
+    {
+        if (clip != other.clip) {
+            return clip < other.clip;
+        }
+        if (time != other.time) {
+            return time < other.time;
+        }
+        if (renderScale.x != other.renderScale.x) {
+            return renderScale.x < other.renderScale.x;
+        }
+        if (renderScale.y != other.renderScale.y) {
+            return renderScale.y < other.renderScale.y;
+        }
+        if (format != other.format) {
+            return format < other.format;
+        }
+
+        return imageId < other.imageId;
+    }
+};
+
+/**
+ * @brief A thread-safe cache of the source frames converted to the input of the flow methods, with the downscaled
+ * proxies of their padded regions, bounded in size. When rendering a sequence, each frame is used up to four times
+ * (as the reference, and as the other frame of the forward and backward flows), and is converted only once.
+ * When the cache is full, the least recently used frames are evicted first, with their proxies.
+ * The cached matrices are shared with the callers, which must not modify them.
+ **/
+class FrameCache
+{
+public:
+    explicit FrameCache(std::size_t maxBytes)
+    : _frames(maxBytes)
+    {
+    }
+
+    bool getImage(const FrameCacheKey & key,
+                  cv::Mat* image,
+                  OfxRectI* bounds)
+    {
+        GetImage visitor(image, bounds);
+
+        return _frames.visit(key, visitor);
+    }
+
+    // replace the image of key, and drop its proxies
+    void insertImage(const FrameCacheKey & key,
+                     const cv::Mat & image,
+                     const OfxRectI & bounds)
+    {
+        Frame frame;
+
+        frame.image = image;
+        frame.bounds = bounds;
+        _frames.insert( key, frame, matBytes(image) );
+    }
+
+    // get the proxy of the image of key padded to bounds, downscaled 2^level times
+    bool getProxy(const FrameCacheKey & key,
+                  const OfxRectI & bounds,
+                  int level,
+                  cv::Mat* proxy)
+    {
+        GetProxy visitor(bounds, level, proxy);
+
+        return _frames.visit(key, visitor);
+    }
+
+    // add a proxy to the image of key, if it is still cached
+    void insertProxy(const FrameCacheKey & key,
+                     const OfxRectI & bounds,
+                     int level,
+                     const cv::Mat & proxy)
+    {
+        InsertProxy visitor(bounds, level, proxy);
+
+        _frames.visit(key, visitor);
+    }
+
+    void clear()
+    {
+        _frames.clear();
+    }
+
+private:
+    struct Proxy
+    {
+        OfxRectI bounds;
+        int level;
+        cv::Mat mat;
+    };
+
+    // the bytes of a frame are those of its image and its proxies
+    struct Frame
+    {
+        cv::Mat image;
+        OfxRectI bounds;
+        std::list<Proxy> proxies;
+    };
+
+    struct GetImage
+    {
+        GetImage(cv::Mat* image_,
+                 OfxRectI* bounds_)
+        : image(image_)
+        , bounds(bounds_)
+        {
+        }
+
+        bool operator()(Frame & frame,
+                        std::size_t* /*bytes*/)
+        {
+            *image = frame.image;
+            *bounds = frame.bounds;
+
+            return true;
+        }
+
+        cv::Mat* image;
+        OfxRectI* bounds;
+    };
+
+    struct GetProxy
+    {
+        GetProxy(const OfxRectI & bounds_,
+                 int level_,
+                 cv::Mat* proxy_)
+        : bounds(bounds_)
+        , level(level_)
+        , proxy(proxy_)
+        {
+        }
+
+        bool operator()(Frame & frame,
+                        std::size_t* /*bytes*/)
+        {
+            std::list<Proxy> & proxies = frame.proxies;
+            for (std::list<Proxy>::iterator p = proxies.begin(); p != proxies.end(); ++p) {
+                if ( (p->level == level) && equalRects(p->bounds, bounds) ) {
+                    *proxy = p->mat;
+                    // the most recently used proxies are kept first
+                    proxies.splice(proxies.begin(), proxies, p);
+
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        OfxRectI bounds;
+        int level;
+        cv::Mat* proxy;
+    };
+
+    struct InsertProxy
+    {
+        InsertProxy(const OfxRectI & bounds_,
+                    int level_,
+                    const cv::Mat & proxy_)
+        : bounds(bounds_)
+        , level(level_)
+        , proxy(proxy_)
+        {
+        }
+
+        bool operator()(Frame & frame,
+                        std::size_t* bytes)
+        {
+            std::list<Proxy> & proxies = frame.proxies;
+            for (std::list<Proxy>::const_iterator p = proxies.begin(); p != proxies.end(); ++p) {
+                if ( (p->level == level) && equalRects(p->bounds, bounds) ) {
+                    // another thread computed the same proxy concurrently
+                    return false;
+                }
+            }
+            // each tile has its own padded bounds, only the last ones are kept
+            if (proxies.size() >= kFrameCacheMaxProxies) {
+                *bytes -= matBytes(proxies.back().mat);
+                proxies.pop_back();
+            }
+            proxies.push_front( Proxy() );
+            proxies.front().bounds = bounds;
+            proxies.front().level = level;
+            proxies.front().mat = proxy;
+            *bytes += matBytes(proxy);
+
+            // the frame is the most recently used, so that it is evicted last
+            return true;
+        }
+
+        OfxRectI bounds;
+        int level;
+        cv::Mat proxy;
+    };
+
+    LRUCache<FrameCacheKey, Frame> _frames;
+};
+
+/**
+ * @brief The support 'halo' at 'levels' pyramid levels above the finest one, capped at kFlowHaloMax. Both are clamped
+ * before shifting, so that any parameter value gives a defined result.
+ **/
+static int
+haloAtLevel(int halo,
+            int levels)
+{
+    // kFlowHaloMax is reached from a support of 1 pixel after this many levels
+    const int maxLevels = 10;
+
+    halo = std::max( 0, std::min(halo, kFlowHaloMax) );
+    levels = std::max( 0, std::min(levels, maxLevels) );
+
+    return std::min(halo << levels, kFlowHaloMax);
+}
+
+/**
+ * @brief The margin, in pixels, around a tile that influences the flow inside this tile. It is the support of the
+ * method at its coarsest pyramid level, which also bounds the displacements that it can find.
+ **/
+static int
+opticalFlowHalo(const OpticalFlowParams & params)
+{
+    int halo = 0;
+
+    switch (params.method) {
+    case eOpticalFlowFarneback:
+        halo = haloAtLevel(kFarnebackWinSize + params.neighborhood, params.levels - 1);
+        break;
+    case eOpticalFlowSimpleFlow:
+        halo = haloAtLevel(params.maxFlow + params.blockSize, params.layers - 1);
+        break;
+    case eOpticalFlowDualTVL1:
+        halo = haloAtLevel(kDualTVL1HaloBase, params.nScales - 1);
+        break;
+    case eOpticalFlowDIS:
+        halo = haloAtLevel(params.patchSize, kDISHaloLevels);
+        break;
+    }
+
+    // the support is in pixels of the downscaled images
+    return haloAtLevel(halo, params.proxyLevel);
+}
+
+/**
+ * @brief The bounds on which the flow from 'ref' to 'other' is computed for the given render window: the render window
+ * and its halo, clipped to the union of the bounds of both images.
+ **/
+static void
+opticalFlowBounds(const OFX::Image* ref,
+                  const OFX::Image* other,
+                  const OfxRectI & renderWindow,
+                  int halo,
+                  OfxRectI* bounds)
+{
+    OfxRectI imagesBounds;
+    unionRects(ref->getBounds(), other->getBounds(), &imagesBounds);
+
+    OfxRectI window = renderWindow;
+    window.x1 -= halo;
+    window.x2 += halo;
+    window.y1 -= halo;
+    window.y2 += halo;
+
+    OfxRectI clipped;
+    intersectRects(window, imagesBounds, &clipped);
+    // the render window may still exceed the images, in which case their borders are replicated
+    unionRects(clipped, renderWindow, bounds);
+}
+
+/**
+ * @brief Crop or extend src, which covers srcBounds, to bounds, replicating its borders.
+ * dst shares the data of src if it does not need to be extended.
+ **/
+static void
+padOpticalFlowInput(const cv::Mat & src,
+                    const OfxRectI & srcBounds,
+                    const OfxRectI & bounds,
+                    cv::Mat* dst)
+{
+    OfxRectI crop;
+    intersectRects(srcBounds, bounds, &crop);
+    assert(crop.x1 < crop.x2 && crop.y1 < crop.y2);
+    cv::Mat cropped( src, cv::Rect(crop.x1 - srcBounds.x1, crop.y1 - srcBounds.y1, crop.x2 - crop.x1, crop.y2 - crop.y1) );
+
+    if ( equalRects(crop, bounds) ) {
+        *dst = cropped;
+
+        return;
+    }
+    copyMakeBorder(cropped, *dst, crop.y1 - bounds.y1, bounds.y2 - crop.y2, crop.x1 - bounds.x1, bounds.x2 - crop.x2, BORDER_REPLICATE);
+}
+
+#if CV_MAJOR_VERSION < 3
+typedef Ptr<DenseOpticalFlow> DualTVL1Ptr;
+#elif defined(VECTOR_GENERATOR_WITH_TVL1_OPTFLOW)
+typedef Ptr<optflow::DualTVL1OpticalFlow> DualTVL1Ptr;
+#else
+typedef Ptr<DualTVL1OpticalFlow> DualTVL1Ptr;
+#endif
+
+static DualTVL1Ptr
+createDualTVL1(const OpticalFlowParams & params)
+{
+#ifdef VECTOR_GENERATOR_WITH_TVL1_OPTFLOW
+    DualTVL1Ptr tvl1 = optflow::createOptFlow_DualTVL1();
+#else
+    DualTVL1Ptr tvl1 = createOptFlow_DualTVL1();
+#endif
+
+#if CV_MAJOR_VERSION < 3
+    tvl1->set("tau", params.tau /*0.25*/);
+    tvl1->set("lambda", params.lambda /*0.15*/);
+    tvl1->set("theta", params.theta /*0.3*/);
+    tvl1->set("nscales", params.nScales /*5*/);
+    tvl1->set("warps", params.warps /*5*/);
+    tvl1->set("epsilon", params.epsilon /*0.01*/);
+    tvl1->set("iterations", params.iterations /*300*/);
+#else
+    tvl1->setTau(params.tau);
+    tvl1->setLambda(params.lambda);
+    tvl1->setTheta(params.theta);
+    tvl1->setScalesNumber(params.nScales);
+    tvl1->setWarpingsNumber(params.warps);
+    tvl1->setEpsilon(params.epsilon);
+#if CV_MAJOR_VERSION >= 4 && !defined(VECTOR_GENERATOR_WITH_TVL1_OPTFLOW)
+    tvl1->setIterations(params.iterations);
+#else
+    tvl1->setInnerIterations(params.iterations);
+#endif
+#endif
+
+    return tvl1;
+}
+
+/**
+ * @brief Dual TV L1 solvers configured with the current parameters, kept across renders so that their setup is done once,
+ * and their buffers stay allocated. A solver is not reentrant, so each solving thread leases its own.
+ * The idle solvers are dropped when the parameters change.
+ **/
+class DualTVL1Pool
+{
+public:
+    DualTVL1Pool()
+    : _mutex()
+    , _params()
+    , _idle()
+    {
+    }
+
+    DualTVL1Ptr acquire(const OpticalFlowParams & params)
+    {
+        std::vector<double> values;
+
+        opticalFlowParamsValues(params, &values);
+        {
+            AutoMutex l(_mutex);
+            if (values != _params) {
+                _idle.clear();
+                _params = values;
+            }
+            if ( !_idle.empty() ) {
+                DualTVL1Ptr tvl1 = _idle.back();
+                _idle.pop_back();
+
+                return tvl1;
+            }
+        }
+
+        return createDualTVL1(params);
+    }
+
+    void release(const OpticalFlowParams & params,
+                 const DualTVL1Ptr & tvl1)
+    {
+        std::vector<double> values;
+
+        opticalFlowParamsValues(params, &values);
+        AutoMutex l(_mutex);
+        if ( (values == _params) && (_idle.size() < kDualTVL1PoolMaxIdle) ) {
+            _idle.push_back(tvl1);
+        }
+    }
+
+    void clear()
+    {
+        AutoMutex l(_mutex);
+
+        _idle.clear();
+    }
+
+private:
+    Mutex _mutex;
+    std::vector<double> _params;
+    std::vector<DualTVL1Ptr> _idle;
+};
+
+// a solver of a DualTVL1Pool, given back to the pool when the lease is destroyed
+class DualTVL1Lease
+{
+public:
+    DualTVL1Lease(DualTVL1Pool* pool,
+                  const OpticalFlowParams & params)
+    : _pool(pool)
+    , _params(params)
+    , _tvl1( pool->acquire(params) )
+    {
+    }
+
+    ~DualTVL1Lease()
+    {
+        _pool->release(_params, _tvl1);
+    }
+
+    const DualTVL1Ptr & get() const
+    {
+        return _tvl1;
+    }
+
+private:
+    // non-copyable
+    DualTVL1Lease(const DualTVL1Lease &);
+    DualTVL1Lease & operator=(const DualTVL1Lease &);
+
+    DualTVL1Pool* _pool;
+    const OpticalFlowParams & _params;
+    DualTVL1Ptr _tvl1;
+};
+
+/**
+ * @brief Compute motion vectors from 'ref' to 'other', which must have the same size, at the resolution of the images.
+ * @param initialFlow[in] If not empty and of the same size, the flow the solver starts from, for the methods that support it.
+ * @param tvl1Pool[in] The pool from which the Dual TV L1 solver is leased.
+ * @param flow[out] A CV_32FC2 matrix of the same size, with vectors expressed in pixels.
+ **/
+static void
+computeOpticalFlow(const cv::Mat & ref,
+                   const cv::Mat & other,
+                   const OpticalFlowParams & params,
+                   const cv::Mat & initialFlow,
+                   DualTVL1Pool* tvl1Pool,
+                   cv::Mat* flow)
+{
+    assert(ref.cols == other.cols && ref.rows == other.rows);
+    // without a seed of the right size (first frame, jump in time, other tile), the solver starts from zero
+    const bool warmStart = params.warmStart && !initialFlow.empty() &&
+                           initialFlow.type() == CV_32FC2 && initialFlow.size() == ref.size();
+    if (warmStart) {
+        // the seed is shared with the FlowSeeds, and is not modified
+        initialFlow.copyTo(*flow);
+    } else {
+        flow->create(ref.rows, ref.cols, CV_32FC2);
+    }
+
+    if (params.method == eOpticalFlowFarneback) {
+        assert(ref.channels() == 1 && other.channels() == 1);
+
+        if (warmStart) {
+            // the seed already holds the large displacements
+            calcOpticalFlowFarneback(ref, other, *flow, kFarnebackPyrScale, params.warmLevels, kFarnebackWinSize, params.warmIterations,
+                                     params.neighborhood, params.sigma, OPTFLOW_USE_INITIAL_FLOW);
+        } else {
+            calcOpticalFlowFarneback(ref, other, *flow, kFarnebackPyrScale, params.levels, kFarnebackWinSize, params.iterations, params.neighborhood, params.sigma, 0);
+        }
+    }
+#if CV_MAJOR_VERSION < 3
+    //Simple flow is commented out in openCV3 for now
+    else if (params.method == eOpticalFlowSimpleFlow) {
+        assert(ref.channels() == 3 && other.channels() == 3);
+        calcOpticalFlowSF(ref, other, *flow, params.layers, params.blockSize, params.maxFlow);
+    }
+#endif
+    else if (params.method == eOpticalFlowDualTVL1) {
+        assert(ref.channels() == 1 && other.channels() == 1);
+        DualTVL1Lease lease(tvl1Pool, params);
+        const DualTVL1Ptr & tvl1 = lease.get();
+#ifdef VECTOR_GENERATOR_WITH_TVL1_INITIAL_FLOW
+#if CV_MAJOR_VERSION < 3
+        tvl1->set("useInitialFlow", warmStart);
+#else
+        tvl1->setUseInitialFlow(warmStart);
+#endif
+#endif
+        tvl1->calc(ref, other, *flow);
+    }
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+    else if (params.method == eOpticalFlowDIS) {
+        assert(ref.type() == CV_8UC1 && other.type() == CV_8UC1);
+#if CV_MAJOR_VERSION >= 4
+        Ptr<DISOpticalFlow> dis = DISOpticalFlow::create( (int)params.disPreset );
+#else
+        Ptr<optflow::DISOpticalFlow> dis = optflow::createOptFlow_DIS( (int)params.disPreset );
+#endif
+        dis->setPatchSize(params.patchSize);
+        dis->setPatchStride(params.patchStride);
+        dis->calc(ref, other, *flow);
+    }
+#endif
+} // computeOpticalFlow
+
+/**
+ * @brief The number of times the images of the given size are downscaled before computing their flow: params.proxyLevel,
+ * unless the downscaled images would be too small.
+ **/
+static int
+opticalFlowProxyLevel(const OpticalFlowParams & params,
+                      const cv::Size & size)
+{
+    int level = params.proxyLevel;
+
+    while ( level > 0 && ( (size.width >> level) < kFlowProxyMinSize || (size.height >> level) < kFlowProxyMinSize ) ) {
+        --level;
+    }
+
+    return level;
+}
+
+/**
+ * @brief Downscale img 2^level times, as the input of the solver.
+ * proxy shares the data of img if level is 0.
+ **/
+static void
+makeOpticalFlowProxy(const cv::Mat & img,
+                     int level,
+                     cv::Mat* proxy)
+{
+    if (level == 0) {
+        *proxy = img;
+
+        return;
+    }
+    cv::Size proxySize( (img.cols + (1 << level) - 1) >> level, (img.rows + (1 << level) - 1) >> level );
+    resize(img, *proxy, proxySize, 0, 0, INTER_AREA);
+}
+
+/**
+ * @brief Compute motion vectors from 'ref' to 'other', which must have the same size. They are the inputs of the solver,
+ * which may be downscaled (see opticalFlowProxyLevel): the flow is then upsampled bilinearly to the given size, and rescaled.
+ * @param initialFlow[in] The flow the solver starts from, at the resolution of the solver, or an empty matrix.
+ * @param flow[out] A CV_32FC2 matrix of the given size, with vectors expressed in pixels.
+ * @param solverFlow[out] The flow at the resolution of the solver, which may share the data of flow.
+ **/
+static void
+solveOpticalFlow(const cv::Mat & ref,
+                 const cv::Mat & other,
+                 const cv::Size & size,
+                 const OpticalFlowParams & params,
+                 const cv::Mat & initialFlow,
+                 DualTVL1Pool* tvl1Pool,
+                 cv::Mat* flow,
+                 cv::Mat* solverFlow)
+{
+    assert(ref.cols == other.cols && ref.rows == other.rows);
+    computeOpticalFlow(ref, other, params, initialFlow, tvl1Pool, solverFlow);
+    if ( ref.size() == size ) {
+        *flow = *solverFlow;
+
+        return;
+    }
+
+    resize(*solverFlow, *flow, size, 0, 0, INTER_LINEAR);
+    // the vectors are in pixels of the downscaled images
+    multiply( *flow, cv::Scalar( (double)size.width / ref.cols, (double)size.height / ref.rows ), *flow );
+} // solveOpticalFlow
+
+/**
+ * @brief A task run on its own thread while an OpticalFlowProcessor solves its jobs. It is skipped if the host gives
+ * no thread for it, and its failure does not fail the solve. It must not use the host suites that are only available
+ * on the render thread, such as the clip image fetches.
+ **/
+class OpticalFlowSideTask
+{
+public:
+    virtual ~OpticalFlowSideTask() {}
+
+    virtual void run() = 0;
+};
+
+/**
+ * @brief Solves several flow fields concurrently, using the threads of the host.
+ **/
+class OpticalFlowProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    OpticalFlowProcessor(const OpticalFlowParams & params,
+                         DualTVL1Pool* tvl1Pool)
+    : _params(params)
+    , _tvl1Pool(tvl1Pool)
+    , _jobs()
+    , _sideTask(NULL)
+    , _mutex()
+    , _failed(false)
+    {
+    }
+
+    // true if a side task would get its own thread
+    bool canRunSideTask() const
+    {
+        return OFX::MultiThread::getNumCPUs() > _jobs.size();
+    }
+
+    // run task alongside the jobs, it must stay valid until process() returns
+    void setSideTask(OpticalFlowSideTask* task)
+    {
+        _sideTask = task;
+    }
+
+    // the matrices must stay valid until process() returns, size is the size of the flow
+    void addJob(const cv::Mat & ref,
+                const cv::Mat & other,
+                const cv::Size & size,
+                const cv::Mat & initialFlow,
+                cv::Mat* flow,
+                cv::Mat* solverFlow)
+    {
+        Job job;
+
+        job.ref = ref;
+        job.other = other;
+        job.size = size;
+        job.initialFlow = initialFlow;
+        job.flow = flow;
+        job.solverFlow = solverFlow;
+        _jobs.push_back(job);
+    }
+
+    // solve all the jobs, each one on its own thread
+    void process()
+    {
+        if ( _jobs.empty() ) {
+            return;
+        }
+        multiThread( (unsigned int)_jobs.size() + (_sideTask ? 1 : 0) );
+        if (_failed) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        // the host may give us less threads than we asked for
+        for (std::size_t i = threadID; i < _jobs.size(); i += nThreads) {
+            try {
+                const Job & job = _jobs[i];
+                solveOpticalFlow(job.ref, job.other, job.size, _params, job.initialFlow, _tvl1Pool, job.flow, job.solverFlow);
+            } catch (...) {
+                // exceptions must not cross the host threads
+                AutoMutex l(_mutex);
+                _failed = true;
+            }
+        }
+        // the side task only runs on a thread of its own, after a job it would delay the solve
+        if ( _sideTask && (nThreads > _jobs.size()) && (threadID == _jobs.size()) ) {
+            try {
+                _sideTask->run();
+            } catch (...) {
+                // the side task is an optimization, its work is done again by whoever needs it
+            }
+        }
+    }
+
+    struct Job
+    {
+        cv::Mat ref;
+        cv::Mat other;
+        cv::Size size;
+        cv::Mat initialFlow;
+        cv::Mat* flow;
+        cv::Mat* solverFlow;
+    };
+
+    const OpticalFlowParams & _params;
+    DualTVL1Pool* _tvl1Pool;
+    std::vector<Job> _jobs;
+    OpticalFlowSideTask* _sideTask;
+    Mutex _mutex;
+    bool _failed;
 };
 
+/**
+ * @brief Writes the motion vectors to the RGBA output, scaled from pixels at the render scale to canonical pixels.
+ * The rows are split across the threads of the host.
+ **/
+class FlowWriterBase
+    : public OFX::ImageProcessor
+{
+public:
+    explicit FlowWriterBase(OFX::ImageEffect & instance)
+    : OFX::ImageProcessor(instance)
+    {
+        for (int c = 0; c < 4; ++c) {
+            _flows[c] = NULL;
+            _bounds[c] = NULL;
+            _coords[c] = 0;
+            _scales[c] = 0.f;
+        }
+    }
+
+    /**
+     * @brief Set the source of each output channel.
+     * @param flow The CV_32FC2 flow, covering bounds, or NULL for a constant 0 channel.
+     * @param coord 0 for the u component of the flow, 1 for the v component.
+     * @param scale The factor applied to the component.
+     **/
+    void setChannel(int c,
+                    const cv::Mat* flow,
+                    const OfxRectI* bounds,
+                    int coord,
+                    float scale)
+    {
+        _flows[c] = flow;
+        _bounds[c] = bounds;
+        _coords[c] = coord;
+        _scales[c] = scale;
+    }
+
+protected:
+    // the first value of the given channel on row y, starting at x
+    const float* getSourceRow(int c,
+                              int x,
+                              int y) const
+    {
+        return _flows[c]->ptr<float>(y - _bounds[c]->y1) + (x - _bounds[c]->x1) * 2 + _coords[c];
+    }
+
+    const cv::Mat* _flows[4];
+    const OfxRectI* _bounds[4];
+    int _coords[4];
+    float _scales[4];
+};
+
+template <FlowLayoutEnum layout>
+class FlowWriter
+    : public FlowWriterBase
+{
+public:
+    explicit FlowWriter(OFX::ImageEffect & instance)
+    : FlowWriterBase(instance)
+    {
+    }
+
+private:
+    virtual void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        const int width = procWindow.x2 - procWindow.x1;
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+            float* dst = (float*)_dstImg->getPixelAddress(procWindow.x1, y);
+            assert(dst);
+            switch (layout) {
+            case eFlowLayoutForwardBackward:
+                // channels 0/1 and 2/3 are the u/v components of the two flows
+                writeInterleavedRow( getSourceRow(0, procWindow.x1, y), getSourceRow(2, procWindow.x1, y), width, dst );
+                break;
+            case eFlowLayoutForward:
+            case eFlowLayoutBackward:
+                writeSingleRow(getSourceRow(0, procWindow.x1, y), width, dst);
+                break;
+            case eFlowLayoutGeneric:
+                writeGenericRow(procWindow.x1, y, width, dst);
+                break;
+            }
+        }
+    }
+
+    // dst = (a.u, a.v, b.u, b.v) * scales
+    void writeInterleavedRow(const float* a,
+                             const float* b,
+                             int width,
+                             float* dst) const
+    {
+#ifdef VECTOR_GENERATOR_WITH_SSE2
+        // one whole pixel at a time, so there is no remainder
+        const __m128 scales = _mm_loadu_ps(_scales);
+        const __m128 zero = _mm_setzero_ps();
+        for (int x = 0; x < width; ++x) {
+            __m128 v = _mm_loadh_pi( _mm_loadl_pi( zero, (const __m64*)(a + 2 * x) ), (const __m64*)(b + 2 * x) );
+            _mm_storeu_ps( dst + 4 * x, _mm_mul_ps(v, scales) );
+        }
+#else
+        for (int x = 0; x < width; ++x) {
+            dst[4 * x] = a[2 * x] * _scales[0];
+            dst[4 * x + 1] = a[2 * x + 1] * _scales[1];
+            dst[4 * x + 2] = b[2 * x] * _scales[2];
+            dst[4 * x + 3] = b[2 * x + 1] * _scales[3];
+        }
+#endif
+    }
+
+    // dst = (a.u, a.v, 0, 0) * scales
+    void writeSingleRow(const float* a,
+                        int width,
+                        float* dst) const
+    {
+        int x = 0;
+#ifdef VECTOR_GENERATOR_WITH_SSE2
+        // two pixels at a time
+        const __m128 scales = _mm_setr_ps(_scales[0], _scales[1], _scales[0], _scales[1]);
+        const __m128 zero = _mm_setzero_ps();
+        for (; x + 2 <= width; x += 2) {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(a + 2 * x), scales);
+            _mm_storeu_ps( dst + 4 * x, _mm_movelh_ps(v, zero) );
+            _mm_storeu_ps( dst + 4 * x + 4, _mm_movehl_ps(zero, v) );
+        }
+#endif
+        for (; x < width; ++x) {
+            dst[4 * x] = a[2 * x] * _scales[0];
+            dst[4 * x + 1] = a[2 * x + 1] * _scales[1];
+            dst[4 * x + 2] = 0.f;
+            dst[4 * x + 3] = 0.f;
+        }
+    }
+
+    void writeGenericRow(int x1,
+                         int y,
+                         int width,
+                         float* dst) const
+    {
+        for (int c = 0; c < 4; ++c) {
+            if (!_flows[c]) {
+                for (int x = 0; x < width; ++x) {
+                    dst[4 * x + c] = 0.f;
+                }
+            } else {
+                const float* src = getSourceRow(c, x1, y);
+                const float scale = _scales[c];
+                for (int x = 0; x < width; ++x) {
+                    dst[4 * x + c] = src[2 * x] * scale;
+                }
+            }
+        }
+    }
+};
 
 static OFX::Color::LutManager<Mutex>* gLutManager;
 
@@ -240,6 +1809,8 @@ public:
     , _bChannel(0)
     , _aChannel(0)
     , _method(0)
+    , _flowQuality(0)
+    , _workingSpace(0)
     , _levels(0)
     , _iteratrions(0)
     , _neighborhood(0)
@@ -253,44 +1824,77 @@ public:
     , _nScales(0)
     , _warps(0)
     , _epsilon(0)
+    , _disPreset(0)
+    , _patchSize(0)
+    , _patchStride(0)
+    , _warmStart(0)
+    , _warmLevels(0)
+    , _warmIterations(0)
+    , _deriveBackward(0)
+    , _prefetch(0)
+    , _flowCache(kFlowCacheMaxBytes)
+    , _flowSeeds(kFlowSeedsMaxBytes)
+    , _frameCache(kFrameCacheMaxBytes)
+    , _tvl1Pool()
     {
         _rChannel = fetchChoiceParam(kParamRChannel);
         _gChannel = fetchChoiceParam(kParamGChannel);
         _bChannel = fetchChoiceParam(kParamBChannel);
         _aChannel = fetchChoiceParam(kParamAChannel);
         _method = fetchChoiceParam(kParamMethod);
-        assert(_rChannel && _gChannel && _bChannel && _aChannel);
-        
+        _flowQuality = fetchChoiceParam(kParamFlowQuality);
+        _workingSpace = fetchChoiceParam(kParamWorkingSpace);
+        assert(_rChannel && _gChannel && _bChannel && _aChannel && _method && _flowQuality && _workingSpace);
+
         _levels = fetchIntParam(kParamLevels);
         _iteratrions = fetchIntParam(kParamIterations);
         _neighborhood = fetchIntParam(kParamPixelNeighborhood);
         _sigma = fetchDoubleParam(kParamSigma);
-        
+
 #ifdef VECTOR_GENERATOR_WITH_SIMPLE_FLOW
         _layers = fetchIntParam(kParamLayers);
         _blockSize = fetchIntParam(kParamBlockSize);
         _maxFlow = fetchIntParam(kParamMaxFlow);
 #endif
-        
+
         _tau = fetchDoubleParam(kParamTau);
         _lambda = fetchDoubleParam(kParamLambda);
         _theta = fetchDoubleParam(kParamTheta);
         _nScales = fetchIntParam(kParamNScales);
         _warps = fetchIntParam(kParamWarps);
         _epsilon = fetchDoubleParam(kParamEpsilon);
-        
+
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+        _disPreset = fetchChoiceParam(kParamDISPreset);
+        _patchSize = fetchIntParam(kParamPatchSize);
+        _patchStride = fetchIntParam(kParamPatchStride);
+#endif
+
+        _warmStart = fetchBooleanParam(kParamWarmStart);
+        _warmLevels = fetchIntParam(kParamWarmLevels);
+        _warmIterations = fetchIntParam(kParamWarmIterations);
+        _deriveBackward = fetchBooleanParam(kParamDeriveBackward);
+        _prefetch = fetchBooleanParam(kParamPrefetch);
+
         assert(_levels && _iteratrions && _neighborhood && _sigma &&
 #ifdef VECTOR_GENERATOR_WITH_SIMPLE_FLOW
                _layers && _blockSize && _maxFlow &&
 #endif
-               _tau && _lambda && _theta && _nScales && _warps && _epsilon);
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+               _disPreset && _patchSize && _patchStride &&
+#endif
+               _tau && _lambda && _theta && _nScales && _warps && _epsilon &&
+               _warmStart && _warmLevels && _warmIterations && _deriveBackward && _prefetch);
 
-        int method_i;
-        _method->getValue(method_i);
-        OpticalFlowMethodEnum method = (OpticalFlowMethodEnum)method_i;
-        updateVisibility(method);
+        updateMethod();
     }
 
+    /**
+     * @brief Add the conversion of src, the source frame at the given time, to the frame cache, for a later render.
+     * Called while the flow of the current render is solved, see FramePrefetchTask.
+     **/
+    void prefetchOpticalFlowInput(const OFX::Image* src, double time, const OpticalFlowParams & params);
+
 private:
     /* Override the render */
     virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
@@ -300,22 +1904,89 @@ private:
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
 
+    // override the roi call, to add the margin needed to compute the flow on a tile
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    /** Override the purge caches action, which frees the cached flow fields and the idle image buffers */
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    void getOpticalFlowParams(double time, const OfxPointD & renderScale, OpticalFlowParams* params);
+
+    /**
+     * @brief Whether the render at the given time fetches the frame that only the render of the next frame needs, and
+     * which. Used by both getFramesNeeded and render, so that this frame is only asked for when it is converted.
+     **/
+    bool getPrefetchTime(double time, bool forwardNeeded, bool backwardNeeded, double* prefetchTime);
+
+    /**
+     * @brief Look for the flow identified by key in the flow cache.
+     * @param deriveFromReverse[in] If true and only the flow in the reverse direction is cached, the result is
+     * obtained by inverting it.
+     * @returns true if flow was set.
+     **/
+    bool getCachedOpticalFlow(const FlowCacheKey & key,
+                              bool deriveFromReverse,
+                              cv::Mat* flow);
+
+    /**
+     * @brief Convert img on window to the input of the optical flow method of params: grayscale in the working space
+     * of params (8-bit or float), or 8-bit RGB for Simple flow.
+     * @param cvImg[out] Holds the converted pixels, and must outlive mat.
+     **/
+    void convertOpticalFlowInput(const OFX::Image* img,
+                                 const OpticalFlowParams & params,
+                                 const OfxRectI & window,
+                                 CVImageWrapper* cvImg,
+                                 cv::Mat* mat);
+
+    /**
+     * @brief Get img, the source frame at the given time, converted by convertOpticalFlowInput. If the host identifies
+     * img, the whole frame is converted once and kept in the frame cache, for the other tiles and flows that use it.
+     * @param cvImg[out] Holds the converted pixels if they are not cached, and must outlive mat.
+     * @param mat[out] The converted image, covering the intersection of window with the bounds of img.
+     * @param matBounds[out] The bounds of mat.
+     * @param key[out] The key of img in the frame cache.
+     * @returns true if img is in the frame cache.
+     **/
+    bool fetchOpticalFlowInput(const OFX::Image* img,
+                               double time,
+                               const OpticalFlowParams & params,
+                               const OfxRectI & window,
+                               CVImageWrapper* cvImg,
+                               cv::Mat* mat,
+                               OfxRectI* matBounds,
+                               FrameCacheKey* key);
+
+    /**
+     * @brief Pad mat, which covers matBounds, to bounds (see padOpticalFlowInput), and downscale it 2^level times,
+     * as the input of the solver. If the frame is cached, the proxy is taken from the frame cache, or added to it.
+     **/
+    void proxyOpticalFlowInput(const FrameCacheKey & key,
+                               bool cached,
+                               const cv::Mat & mat,
+                               const OfxRectI & matBounds,
+                               const OfxRectI & bounds,
+                               int level,
+                               cv::Mat* proxy);
+
     /**
-     * @brief Compute motion vectors from 'ref' to 'other' on the given renderWindow and set them in the given channel indexes
-     * of the dst Image.
-     * @param channelIndex[in] A vector for each coordinate (x,y) of components of the output image to fill.
-     * Each componentn will be a value between [0 , 3] targeting one of the R/G/B/A channels of the dst image.
+     * @brief Set the motion vectors on the given renderWindow of the dst Image, in one pass.
+     * @param channels[in] The ChannelEnum selected for each of the R/G/B/A channels of the dst image.
+     * The forward (resp. backward) flow may be empty if no channel uses it.
      **/
-    void calcOpticalFlow(const OFX::Image* ref,
-                         const OFX::Image* other,
-                         const OfxPointD & renderScale,
-                         const OfxRectI & renderWindow,
-                         std::vector<int> channelIndex[2],
-                         OpticalFlowMethodEnum method,
-                         OFX::Image* dst);
+    void writeOpticalFlow(const cv::Mat & forwardFlow,
+                          const OfxRectI & forwardBounds,
+                          const cv::Mat & backwardFlow,
+                          const OfxRectI & backwardBounds,
+                          const int channels[4],
+                          const OfxPointD & renderScale,
+                          const OfxRectI & renderWindow,
+                          OFX::Image* dst);
 
     void updateVisibility(OpticalFlowMethodEnum method);
 
+    void updateMethod();
+
 private:
 
     ChoiceParam* _rChannel;
@@ -323,22 +1994,24 @@ private:
     ChoiceParam* _bChannel;
     ChoiceParam* _aChannel;
     ChoiceParam* _method;
-    
+    ChoiceParam* _flowQuality;
+    ChoiceParam* _workingSpace;
+
     //Farneback
     IntParam* _levels;
-    
+
     //Farneback + DUAL TV L1
     IntParam* _iteratrions;
-    
+
     //Farneback
     IntParam* _neighborhood;
     DoubleParam* _sigma;
-    
+
     //Simple flow
     IntParam* _layers;
     IntParam* _blockSize;
     IntParam* _maxFlow;
-    
+
     //Dual TV L1
     DoubleParam* _tau;
     DoubleParam* _lambda;
@@ -346,178 +2019,384 @@ private:
     IntParam* _nScales;
     IntParam* _warps;
     DoubleParam* _epsilon;
-    
+
+    //DIS
+    ChoiceParam* _disPreset;
+    IntParam* _patchSize;
+    IntParam* _patchStride;
+
+    BooleanParam* _warmStart;
+
+    //Farneback
+    IntParam* _warmLevels;
+    IntParam* _warmIterations;
+
+    BooleanParam* _deriveBackward;
+    BooleanParam* _prefetch;
+
+    FlowCache _flowCache;
+
+    // the last solved flows, from which the next frames start
+    FlowSeeds _flowSeeds;
+
+    // the converted source frames, shared by the flows that use them
+    FrameCache _frameCache;
+
+    DualTVL1Pool _tvl1Pool;
 };
 
 void
-VectorGeneratorPlugin::calcOpticalFlow(const OFX::Image* ref,
-                                       const OFX::Image* other,
-                                       const OfxPointD& renderScale,
-                                       const OfxRectI & renderWindow,
-                                       std::vector<int> channelIndex[2],
-                                       OpticalFlowMethodEnum method,
-                                       OFX::Image* dst)
+VectorGeneratorPlugin::getOpticalFlowParams(double time,
+                                            const OfxPointD & renderScale,
+                                            OpticalFlowParams* params)
 {
-    assert(dst->getPixelComponents() == OFX::ePixelComponentRGBA);
-    const int nComponents = 4;
+    int method_i;
+    _method->getValueAtTime(time, method_i);
+    params->method = methodFromOption(method_i);
+
+    // the images are already downscaled by the host at render scales lower than 1
+    int flowQuality_i;
+    _flowQuality->getValueAtTime(time, flowQuality_i);
+    params->proxyLevel = 0;
+    double proxyScale = renderScale.x;
+    while (params->proxyLevel < flowQuality_i && proxyScale > 1. / (1 << flowQuality_i) ) {
+        proxyScale /= 2;
+        ++params->proxyLevel;
+    }
 
+    int workingSpace_i;
+    _workingSpace->getValueAtTime(time, workingSpace_i);
+    params->workingSpace = supportsFloatInput(params->method) ? (WorkingSpaceEnum)workingSpace_i : eWorkingSpaceSRGB8;
 
-    const OfxRectI& refBounds = ref->getBounds();
-    const OfxRectI& otherBounds = ref->getBounds();
-    OfxRectI bounds;
-    bounds.x1 = std::min(refBounds.x1, otherBounds.x1);
-    bounds.x2 = std::max(refBounds.x2, otherBounds.x2);
-    bounds.y1 = std::min(refBounds.y1, otherBounds.y1);
-    bounds.y2 = std::max(refBounds.y2, otherBounds.y2);
-    cv::Mat flow(bounds.y2 - bounds.y1, bounds.x2 - bounds.x1, CV_32FC2);
+    _levels->getValueAtTime(time, params->levels);
+    _iteratrions->getValueAtTime(time, params->iterations);
+    _neighborhood->getValueAtTime(time, params->neighborhood);
+    _sigma->getValueAtTime(time, params->sigma);
 
-    if (method == eOpticalFlowFarneback) {
-        // works in grayscale
-        CVImageWrapper srcRef, srcOther;
-        fetchCVImage8UGrayscale(ref, renderWindow, true, &srcRef);
-        fetchCVImage8UGrayscale(other, renderWindow, true, &srcOther);
-#if CV_MAJOR_VERSION >= 3
-        cv::Mat srcRefMatImg = *srcRef.getCvMat();
-        cv::Mat srcOtherMatImg = *srcOther.getCvMat();
-#else
-        cv::Mat srcRefMatImg(srcRef.getIplImage(), false /*copyData*/);
-        cv::Mat srcOtherMatImg(srcOther.getIplImage(), false /*copyData*/);
-#endif
-
-        copyMakeBorder(srcRefMatImg, srcRefMatImg, refBounds.y1 - bounds.y1, bounds.y2 - refBounds.y2, refBounds.x1 - bounds.x1, bounds.x2 - refBounds.x2, BORDER_REPLICATE);
-        copyMakeBorder(srcOtherMatImg, srcOtherMatImg, otherBounds.y1 - bounds.y1, bounds.y2 - otherBounds.y2, otherBounds.x1 - bounds.x1, bounds.x2 - otherBounds.x2, BORDER_REPLICATE);
-        
-        int nbLevels;// = 3;
-        double pyrScale = 0.5;
-        int nbIterations;// = 15;
-        int polyN;// = 5;
-        double polySigma;// = 1.1;
-        int winSize = 3;
-        _levels->getValue(nbLevels);
-        _iteratrions->getValue(nbIterations);
-        _neighborhood->getValue(polyN);
-        _sigma->getValue(polySigma);
-        assert(srcRefMatImg.cols == flow.cols && srcRefMatImg.rows == flow.rows && srcOtherMatImg.cols == flow.cols && srcOtherMatImg.rows == flow.rows);
-        assert(srcRefMatImg.channels() == 1 && srcOtherMatImg.channels() == 1);
-
-        calcOpticalFlowFarneback(srcRefMatImg, srcOtherMatImg, flow, pyrScale, nbLevels, winSize, nbIterations, polyN, polySigma, 0);
-//#endif
-        
-    }
-    
-    
-#if CV_MAJOR_VERSION < 3
-    //Simple flow is commented out in openCV3 for now
-    else if (method == eOpticalFlowSimpleFlow) {
+    params->layers = params->blockSize = params->maxFlow = 0;
+#ifdef VECTOR_GENERATOR_WITH_SIMPLE_FLOW
+    _layers->getValueAtTime(time, params->layers);
+    _blockSize->getValueAtTime(time, params->blockSize);
+    _maxFlow->getValueAtTime(time, params->maxFlow);
+#endif
+
+    _tau->getValueAtTime(time, params->tau);
+    _lambda->getValueAtTime(time, params->lambda);
+    _theta->getValueAtTime(time, params->theta);
+    _nScales->getValueAtTime(time, params->nScales);
+    _warps->getValueAtTime(time, params->warps);
+    _epsilon->getValueAtTime(time, params->epsilon);
+
+    params->disPreset = eDISPresetFast;
+    params->patchSize = gDISPresetPatchSize[eDISPresetFast];
+    params->patchStride = gDISPresetPatchStride[eDISPresetFast];
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+    int disPreset_i;
+    _disPreset->getValueAtTime(time, disPreset_i);
+    params->disPreset = (DISPresetEnum)std::max( (int)eDISPresetUltrafast, std::min(disPreset_i, (int)eDISPresetMedium) );
+    _patchSize->getValueAtTime(time, params->patchSize);
+    _patchStride->getValueAtTime(time, params->patchStride);
+    params->patchSize = std::max(2, params->patchSize);
+    params->patchStride = std::max( 1, std::min(params->patchStride, params->patchSize) );
+#endif
+
+    _warmStart->getValueAtTime(time, params->warmStart);
+    params->warmStart = params->warmStart && supportsInitialFlow(params->method);
+    _warmLevels->getValueAtTime(time, params->warmLevels);
+    _warmIterations->getValueAtTime(time, params->warmIterations);
+    params->warmLevels = std::max( 1, std::min(params->warmLevels, params->levels) );
+    params->warmIterations = std::max( 1, std::min(params->warmIterations, params->iterations) );
+}
+
+/**
+ * @brief Fill the cache key of the flow from 'ref' to 'other'.
+ * @returns false if the host does not give unique identifiers to the images, in which case the flow cannot be cached.
+ **/
+static bool
+makeFlowCacheKey(const OFX::Image* ref,
+                 const OFX::Image* other,
+                 const OpticalFlowParams & params,
+                 const OfxRectI & bounds,
+                 const OfxPointD & renderScale,
+                 FlowCacheKey* key)
+{
+    key->refId = ref->getUniqueIdentifier();
+    key->otherId = other->getUniqueIdentifier();
+    if ( key->refId.empty() || key->otherId.empty() ) {
+        return false;
+    }
+    key->bounds = bounds;
+    key->renderScale = renderScale;
+    opticalFlowParamsValues(params, &key->params);
+
+    return true;
+}
+
+// fill the key of the flow seeds from which the flow in the given direction (1 forward, -1 backward) starts
+static void
+makeFlowSeedKey(const OpticalFlowParams & params,
+                int direction,
+                const OfxRectI & bounds,
+                const OfxPointD & renderScale,
+                FlowSeedKey* key)
+{
+    key->direction = direction;
+    key->bounds = bounds;
+    key->renderScale = renderScale;
+    opticalFlowParamsValues(params, &key->params);
+}
+
+bool
+VectorGeneratorPlugin::getCachedOpticalFlow(const FlowCacheKey & key,
+                                            bool deriveFromReverse,
+                                            cv::Mat* flow)
+{
+    if ( _flowCache.get(key, flow) ) {
+        return true;
+    }
+    if (deriveFromReverse) {
+        FlowCacheKey reverseKey = key;
+        std::swap(reverseKey.refId, reverseKey.otherId);
+        cv::Mat reverseFlow;
+        if ( _flowCache.get(reverseKey, &reverseFlow) ) {
+            // the inverted flow is cheap to recompute, do not fill the cache with it
+            invertFlow(reverseFlow, flow);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// fill the key of img, the source frame at the given time, in the frame cache
+static bool
+makeFrameCacheKey(const OFX::Image* img,
+                  const std::string & clip,
+                  double time,
+                  const OpticalFlowParams & params,
+                  FrameCacheKey* key)
+{
+    key->imageId = img->getUniqueIdentifier();
+    if ( key->imageId.empty() ) {
+        return false;
+    }
+    key->clip = clip;
+    key->time = time;
+    key->renderScale = img->getRenderScale();
+    if (params.method == eOpticalFlowSimpleFlow) {
+        key->format = eFlowInputRGB8;
+    } else if (params.workingSpace == eWorkingSpaceSRGB8) {
+        key->format = eFlowInputGray8;
+    } else if (params.workingSpace == eWorkingSpaceLog) {
+        key->format = eFlowInputGray32Log;
+    } else {
+        key->format = eFlowInputGray32Linear;
+    }
+
+    return true;
+}
+
+void
+VectorGeneratorPlugin::convertOpticalFlowInput(const OFX::Image* img,
+                                               const OpticalFlowParams & params,
+                                               const OfxRectI & window,
+                                               CVImageWrapper* cvImg,
+                                               cv::Mat* mat)
+{
+    if (params.method == eOpticalFlowSimpleFlow) {
         // works in color
-        CVImageWrapper srcRef,srcOther;
-        fetchCVImage8U(ref, renderWindow, true, &srcRef, ePixelComponentRGB);
-        fetchCVImage8U(other, renderWindow, true, &srcOther, ePixelComponentRGB);
-        
-
-        cv::Mat srcRefMatImg(srcRef.getIplImage(), false /*copyData*/);
-        cv::Mat srcOtherMatImg(srcOther.getIplImage(), false /*copyData*/);
-        
-        
-        copyMakeBorder(srcRefMatImg, srcRefMatImg, refBounds.y1 - bounds.y1, bounds.y2 - refBounds.y2, refBounds.x1 - bounds.x1, bounds.x2 - refBounds.x2, BORDER_REPLICATE);
-        copyMakeBorder(srcOtherMatImg, srcOtherMatImg, otherBounds.y1 - bounds.y1, bounds.y2 - otherBounds.y2, otherBounds.x1 - bounds.x1, bounds.x2 - otherBounds.x2, BORDER_REPLICATE);
-
-        int nbLayers;// = 3;
-        int avgBlockSize;// = 2;
-        int maxFlow;// = 4;
-        _layers->getValue(nbLayers);
-        _blockSize->getValue(avgBlockSize);
-        _maxFlow->getValue(maxFlow);
-        assert(srcRefMatImg.cols == flow.cols && srcRefMatImg.rows == flow.rows && srcOtherMatImg.cols == flow.cols && srcOtherMatImg.rows == flow.rows);
-        assert(srcRefMatImg.channels() == 3 && srcOtherMatImg.channels() == 3);
-        calcOpticalFlowSF(srcRefMatImg, srcOtherMatImg, flow, nbLayers, avgBlockSize, maxFlow);
-    }
-#endif
-    else if (method == eOpticalFlowDualTVL1) {
+        fetchCVImage8U(img, window, true, cvImg, ePixelComponentRGB, 3);
+    } else if (params.workingSpace == eWorkingSpaceSRGB8) {
         // works in grayscale
-        CVImageWrapper srcRef,srcOther;
-        fetchCVImage8UGrayscale(ref, renderWindow, true, &srcRef);
-        fetchCVImage8UGrayscale(other, renderWindow, true, &srcOther);
-        
+        fetchCVImage8UGrayscale(img, window, true, cvImg);
+    } else {
+        // the solvers also take float images, which skips the 8-bit sRGB conversion
+        fetchCVImage32FGrayscale(img, window, params.workingSpace == eWorkingSpaceLog ? eCVWorkingSpaceLog : eCVWorkingSpaceLinear, cvImg);
+    }
 #if CV_MAJOR_VERSION >= 3
-        cv::Mat srcRefMatImg(*srcRef.getCvMat());
-        cv::Mat srcOtherMatImg(*srcOther.getCvMat());
+    *mat = *cvImg->getCvMat();
 #else
-        cv::Mat srcRefMatImg(srcRef.getIplImage(), false /*copyData*/);
-        cv::Mat srcOtherMatImg(srcOther.getIplImage(), false /*copyData*/);
+    *mat = cv::Mat(cvImg->getIplImage(), false /*copyData*/);
 #endif
-        copyMakeBorder(srcRefMatImg, srcRefMatImg, refBounds.y1 - bounds.y1, bounds.y2 - refBounds.y2, refBounds.x1 - bounds.x1, bounds.x2 - refBounds.x2, BORDER_REPLICATE);
-        copyMakeBorder(srcOtherMatImg, srcOtherMatImg, otherBounds.y1 - bounds.y1, bounds.y2 - otherBounds.y2, otherBounds.x1 - bounds.x1, bounds.x2 - otherBounds.x2, BORDER_REPLICATE);
+}
 
-#if CV_MAJOR_VERSION < 3
-        Ptr<DenseOpticalFlow> tvl1 = createOptFlow_DualTVL1();
-#else
-        Ptr<DualTVL1OpticalFlow> tvl1 = createOptFlow_DualTVL1();
-#endif
-        double tau,lambda,theta,epsilon;
-        int nScales,warps,iterations;
-        
-        _tau->getValue(tau);
-        _lambda->getValue(lambda);
-        _theta->getValue(theta);
-        _epsilon->getValue(epsilon);
-        
-        _nScales->getValue(nScales);
-        _warps->getValue(warps);
-        _iteratrions->getValue(iterations);
-        assert(srcRefMatImg.cols == flow.cols && srcRefMatImg.rows == flow.rows && srcOtherMatImg.cols == flow.cols && srcOtherMatImg.rows == flow.rows);
-        assert(srcRefMatImg.channels() == 1 && srcOtherMatImg.channels() == 1);
-#if CV_MAJOR_VERSION < 3
-        tvl1->set("tau",tau /*0.25*/);
-        tvl1->set("lambda",lambda /*0.15*/);
-        tvl1->set("theta",theta /*0.3*/);
-        tvl1->set("nscales",nScales /*5*/);
-        tvl1->set("warps", warps/*5*/);
-        tvl1->set("epsilon", epsilon/*0.01*/);
-        tvl1->set("iterations", iterations/*300*/);
-#else
-        tvl1->setTau(tau);
-        tvl1->setLambda(lambda);
-        tvl1->setTheta(theta);
-        tvl1->setScalesNumber(nScales);
-        tvl1->setWarpingsNumber(warps);
-        tvl1->setEpsilon(epsilon);
-#if CV_MAJOR_VERSION >= 4
-        tvl1->setIterations(iterations);
-#else
-        tvl1->setInnerIterations(iterations);
-#endif
-#endif
-        tvl1->calc(srcRefMatImg,srcOtherMatImg,flow);
+bool
+VectorGeneratorPlugin::fetchOpticalFlowInput(const OFX::Image* img,
+                                             double time,
+                                             const OpticalFlowParams & params,
+                                             const OfxRectI & window,
+                                             CVImageWrapper* cvImg,
+                                             cv::Mat* mat,
+                                             OfxRectI* matBounds,
+                                             FrameCacheKey* key)
+{
+    intersectRects(img->getBounds(), window, matBounds);
+    if ( (matBounds->x1 >= matBounds->x2) || (matBounds->y1 >= matBounds->y2) ) {
+        // the host did not give the region we asked for in getRegionsOfInterest
+        OFX::throwSuiteStatusException(kOfxStatFailed);
     }
+    if ( !makeFrameCacheKey(img, _srcClip->name(), time, params, key) ) {
+        convertOpticalFlowInput(img, params, *matBounds, cvImg, mat);
 
-    IplImage flowImg = (IplImage)flow;
+        return false;
+    }
 
-    assert( flowImg.imageSize >= (flow.rows * flow.cols * sizeof(float) * 2) );
+    cv::Mat frame;
+    OfxRectI frameBounds;
+    OfxRectI covered;
+    if ( _frameCache.getImage(*key, &frame, &frameBounds) ) {
+        intersectRects(frameBounds, *matBounds, &covered);
+    }
+    if ( frame.empty() || !equalRects(covered, *matBounds) ) {
+        frameBounds = img->getBounds();
+        CVImageWrapper frameImg;
+        cv::Mat frameView;
+        convertOpticalFlowInput(img, params, frameBounds, &frameImg, &frameView);
+        // the cache owns its pixels, the buffer of frameImg goes back to the pool
+        frame = frameView.clone();
+        _frameCache.insertImage(*key, frame, frameBounds);
+    }
+    *mat = cv::Mat( frame, cv::Rect(matBounds->x1 - frameBounds.x1, matBounds->y1 - frameBounds.y1,
+                                    matBounds->x2 - matBounds->x1, matBounds->y2 - matBounds->y1) );
 
-    int dstElemCount = dst->getRowBytes() / sizeof(float);
-    int flowElemCount = flowImg.widthStep / sizeof(float);
-    float* dst_pixels = (float*)dst->getPixelAddress(renderWindow.x1, renderWindow.y1);
-    const float* src_pixels = (reinterpret_cast<const float*>(flowImg.imageData) +
-                               (renderWindow.x1 - bounds.x1) +
-                               (renderWindow.y1 - bounds.y1) * flowElemCount);
-    assert(dst_pixels && src_pixels);
+    return true;
+}
 
+void
+VectorGeneratorPlugin::proxyOpticalFlowInput(const FrameCacheKey & key,
+                                             bool cached,
+                                             const cv::Mat & mat,
+                                             const OfxRectI & matBounds,
+                                             const OfxRectI & bounds,
+                                             int level,
+                                             cv::Mat* proxy)
+{
+    // at full resolution, the padded input is a view of the frame, unless it is extended
+    const bool cacheable = cached && level > 0;
 
-    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
-        for (int x = renderWindow.x1; x < renderWindow.x2; ++x) {
-            for (int coord = 0; coord < 2; ++coord) {
-                float v = src_pixels[x * 2 + coord] / (coord == 0 ? renderScale.x : renderScale.y);
-                for (int k = 0; k < channelIndex[coord].size(); ++k) {
-                    assert(channelIndex[coord][k] >= 0 && channelIndex[coord][k] <= 3);
-                    dst_pixels[x * nComponents + channelIndex[coord][k]] = v;
-                }
-            }
+    if ( cacheable && _frameCache.getProxy(key, bounds, level, proxy) ) {
+        return;
+    }
+    cv::Mat padded;
+    padOpticalFlowInput(mat, matBounds, bounds, &padded);
+    makeOpticalFlowProxy(padded, level, proxy);
+    if (cacheable) {
+        _frameCache.insertProxy(key, bounds, level, *proxy);
+    }
+}
+
+void
+VectorGeneratorPlugin::prefetchOpticalFlowInput(const OFX::Image* src,
+                                                double time,
+                                                const OpticalFlowParams & params)
+{
+    CVImageWrapper cvImg;
+    cv::Mat mat;
+    OfxRectI matBounds;
+    FrameCacheKey key;
+
+    fetchOpticalFlowInput(src, time, params, src->getBounds(), &cvImg, &mat, &matBounds, &key);
+}
+
+// the conversion of a prefetched source frame, run while the flow is solved
+class FramePrefetchTask
+    : public OpticalFlowSideTask
+{
+public:
+    FramePrefetchTask(VectorGeneratorPlugin* plugin,
+                      const OFX::Image* src,
+                      double time,
+                      const OpticalFlowParams & params)
+    : _plugin(plugin)
+    , _src(src)
+    , _time(time)
+    , _params(params)
+    {
+    }
+
+    virtual void run() OVERRIDE FINAL
+    {
+        _plugin->prefetchOpticalFlowInput(_src, _time, _params);
+    }
+
+private:
+    VectorGeneratorPlugin* _plugin;
+    const OFX::Image* _src;
+    double _time;
+    const OpticalFlowParams & _params;
+};
+
+void
+VectorGeneratorPlugin::writeOpticalFlow(const cv::Mat & forwardFlow,
+                                        const OfxRectI & forwardBounds,
+                                        const cv::Mat & backwardFlow,
+                                        const OfxRectI & backwardBounds,
+                                        const int channels[4],
+                                        const OfxPointD & renderScale,
+                                        const OfxRectI & renderWindow,
+                                        OFX::Image* dst)
+{
+    assert(dst->getPixelComponents() == OFX::ePixelComponentRGBA);
+
+    // the channel mapping is resolved once, to the writer specialized for it
+    FlowLayoutEnum layout = eFlowLayoutGeneric;
+    if ( (channels[0] == eChannelForwardU) && (channels[1] == eChannelForwardV) &&
+         (channels[2] == eChannelBackwardU) && (channels[3] == eChannelBackwardV) ) {
+        layout = eFlowLayoutForwardBackward;
+    } else if ( (channels[0] == eChannelForwardU) && (channels[1] == eChannelForwardV) && (channels[2] == eChannelNone) && (channels[3] == eChannelNone) ) {
+        layout = eFlowLayoutForward;
+    } else if ( (channels[0] == eChannelBackwardU) && (channels[1] == eChannelBackwardV) && (channels[2] == eChannelNone) && (channels[3] == eChannelNone) ) {
+        layout = eFlowLayoutBackward;
+    }
+
+    std::auto_ptr<FlowWriterBase> writer;
+    switch (layout) {
+    case eFlowLayoutForwardBackward:
+        writer.reset( new FlowWriter<eFlowLayoutForwardBackward>(*this) );
+        break;
+    case eFlowLayoutForward:
+        writer.reset( new FlowWriter<eFlowLayoutForward>(*this) );
+        break;
+    case eFlowLayoutBackward:
+        writer.reset( new FlowWriter<eFlowLayoutBackward>(*this) );
+        break;
+    case eFlowLayoutGeneric:
+        writer.reset( new FlowWriter<eFlowLayoutGeneric>(*this) );
+        break;
+    }
+
+    // the vectors are in pixels at the render scale, the reciprocal scales are applied as products
+    const float scaleU = (float)(1. / renderScale.x);
+    const float scaleV = (float)(1. / renderScale.y);
+    for (int c = 0; c < 4; ++c) {
+        const cv::Mat* flow = NULL;
+        const OfxRectI* bounds = NULL;
+        switch (channels[c]) {
+        case eChannelForwardU:
+        case eChannelForwardV:
+            flow = &forwardFlow;
+            bounds = &forwardBounds;
+            break;
+        case eChannelBackwardU:
+        case eChannelBackwardV:
+            flow = &backwardFlow;
+            bounds = &backwardBounds;
+            break;
+        default:
+            break;
         }
-        dst_pixels += dstElemCount;
-        src_pixels += flowElemCount;
+        const int coord = (channels[c] == eChannelForwardU || channels[c] == eChannelBackwardU) ? 0 : 1;
+        assert( !flow || flow->type() == CV_32FC2 );
+        assert( !flow || (bounds->x1 <= renderWindow.x1 && renderWindow.x2 <= bounds->x2 &&
+                          bounds->y1 <= renderWindow.y1 && renderWindow.y2 <= bounds->y2) );
+        writer->setChannel(c, flow, bounds, coord, coord == 0 ? scaleU : scaleV);
     }
-} // calcOpticalFlow
+
+    writer->setDstImg(dst);
+    writer->setRenderWindow(renderWindow);
+    writer->process();
+} // writeOpticalFlow
 
 // the overridden render function
 void
@@ -543,102 +2422,185 @@ VectorGeneratorPlugin::render(const OFX::RenderArguments &args)
         OFX::throwSuiteStatusException(kOfxStatFailed);
     }
 
+    int channels[4];
+    _rChannel->getValue(channels[0]);
+    _gChannel->getValue(channels[1]);
+    _bChannel->getValue(channels[2]);
+    _aChannel->getValue(channels[3]);
+
+    bool forwardNeeded = false;
+    bool backwardNeeded = false;
+    for (int c = 0; c < 4; ++c) {
+        forwardNeeded = forwardNeeded || channels[c] == eChannelForwardU || channels[c] == eChannelForwardV;
+        backwardNeeded = backwardNeeded || channels[c] == eChannelBackwardU || channels[c] == eChannelBackwardV;
+    }
 
-    int rChannel, bChannel, gChannel, aChannel;
-    _rChannel->getValue(rChannel);
-    _gChannel->getValue(gChannel);
-    _bChannel->getValue(bChannel);
-    _aChannel->getValue(aChannel);
-
-    bool forwardNeeded = rChannel == 1 || rChannel == 2 || gChannel == 1 || gChannel == 2 || bChannel == 1 || bChannel == 2 || aChannel == 1 || aChannel == 2;
-    bool backwardNeeded = rChannel == 3 || rChannel == 4 || gChannel == 3 || gChannel == 4 || bChannel == 3 || bChannel == 4 || aChannel == 3 || aChannel == 4;
-    int method_i;
-    _method->getValue(method_i);
-    OpticalFlowMethodEnum method = (OpticalFlowMethodEnum)method_i;
-
-    if (forwardNeeded) {
-        //Other image for "backward" optical flow computation
-        std::auto_ptr<const OFX::Image> srcOther((_srcClip && _srcClip->isConnected()) ?
-                                                _srcClip->fetchImage(args.time+1) : 0);
-        if ( !srcOther.get() ) {
-            OFX::throwSuiteStatusException(kOfxStatFailed);
+    OpticalFlowParams params;
+    getOpticalFlowParams(args.time, args.renderScale, &params);
+    if ( !isMethodAvailable(params.method) ) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "The selected method was not available when the plugin was compiled");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    bool deriveBackward;
+    _deriveBackward->getValueAtTime(args.time, deriveBackward);
+    const bool warmStart = params.warmStart;
+
+    //Other images for "forward" and "backward" optical flow computation
+    std::auto_ptr<const OFX::Image> srcNext((forwardNeeded && _srcClip && _srcClip->isConnected()) ?
+                                            _srcClip->fetchImage(args.time+1) : 0);
+    if ( forwardNeeded && !srcNext.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    std::auto_ptr<const OFX::Image> srcPrev((backwardNeeded && _srcClip && _srcClip->isConnected()) ?
+                                            _srcClip->fetchImage(args.time-1) : 0);
+    if ( backwardNeeded && !srcPrev.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    // the frame that the render at t+1 needs and this one does not. It is fetched on the render thread, and only
+    // its conversion, which is kept in the frame cache, is useful
+    double prefetchTime = 0.;
+    std::auto_ptr<const OFX::Image> srcPrefetch;
+    if ( getPrefetchTime(args.time, forwardNeeded, backwardNeeded, &prefetchTime) ) {
+        srcPrefetch.reset( _srcClip->fetchImage(prefetchTime) );
+        if ( srcPrefetch.get() && srcPrefetch->getUniqueIdentifier().empty() ) {
+            srcPrefetch.reset();
         }
+    }
+    bool prefetchConverted = false;
+
+    // only the render window and the margin that influences it are computed
+    const int halo = opticalFlowHalo(params);
+    cv::Mat forwardFlow, backwardFlow;
+    OfxRectI forwardBounds, backwardBounds;
+    FlowCacheKey forwardKey, backwardKey;
+    bool forwardCacheable = false;
+    bool backwardCacheable = false;
+    bool forwardSolve = false;
+    bool backwardSolve = false;
+    if (forwardNeeded) {
+        opticalFlowBounds(srcRef.get(), srcNext.get(), args.renderWindow, halo, &forwardBounds);
+        forwardCacheable = makeFlowCacheKey(srcRef.get(), srcNext.get(), params, forwardBounds, args.renderScale, &forwardKey);
+        forwardSolve = !forwardCacheable || !getCachedOpticalFlow(forwardKey, false, &forwardFlow);
+    }
+    if (backwardNeeded) {
+        // the backward flow from t to t-1 is the reverse of the forward flow computed when rendering t-1
+        opticalFlowBounds(srcRef.get(), srcPrev.get(), args.renderWindow, halo, &backwardBounds);
+        backwardCacheable = makeFlowCacheKey(srcRef.get(), srcPrev.get(), params, backwardBounds, args.renderScale, &backwardKey);
+        backwardSolve = !backwardCacheable || !getCachedOpticalFlow(backwardKey, deriveBackward, &backwardFlow);
+    }
 
-
-        std::vector<int> channelIndex[2];
-        channelIndex[0] = std::vector<int>();
-        channelIndex[1] = std::vector<int>();
-        if (rChannel == 1) {
-            channelIndex[0].push_back(0);
+    if (forwardSolve || backwardSolve) {
+        // the reference frame is converted only once, and padded and downscaled once if both flows have the same bounds
+        OfxRectI refWindow;
+        if (forwardSolve && backwardSolve) {
+            unionRects(forwardBounds, backwardBounds, &refWindow);
+        } else {
+            refWindow = forwardSolve ? forwardBounds : backwardBounds;
         }
-        if (gChannel == 1) {
-            channelIndex[0].push_back(1);
-        }
-        if (bChannel == 1) {
-            channelIndex[0].push_back(2);
+        CVImageWrapper refImg, nextImg, prevImg;
+        cv::Mat refMat, nextMat, prevMat;
+        OfxRectI refMatBounds, nextMatBounds, prevMatBounds;
+        FrameCacheKey refKey, nextKey, prevKey;
+        const bool refCached = fetchOpticalFlowInput(srcRef.get(), args.time, params, refWindow, &refImg, &refMat, &refMatBounds, &refKey);
+
+        OpticalFlowProcessor processor(params, &_tvl1Pool);
+        cv::Mat refForward, refBackward, nextProxy, prevProxy;
+        // the flows of the previous frame, from which the solvers start, and the flows to start the next frame from
+        FlowSeedKey forwardSeedKey, backwardSeedKey;
+        cv::Mat forwardSeed, backwardSeed, forwardSolverFlow, backwardSolverFlow;
+        if (forwardSolve) {
+            const bool nextCached = fetchOpticalFlowInput(srcNext.get(), args.time + 1, params, forwardBounds, &nextImg, &nextMat, &nextMatBounds, &nextKey);
+            const int level = opticalFlowProxyLevel( params, rectSize(forwardBounds) );
+            proxyOpticalFlowInput(refKey, refCached, refMat, refMatBounds, forwardBounds, level, &refForward);
+            proxyOpticalFlowInput(nextKey, nextCached, nextMat, nextMatBounds, forwardBounds, level, &nextProxy);
+            if (warmStart) {
+                makeFlowSeedKey(params, 1, forwardBounds, args.renderScale, &forwardSeedKey);
+                _flowSeeds.get(forwardSeedKey, args.time, &forwardSeed);
+            }
+            processor.addJob(refForward, nextProxy, rectSize(forwardBounds), forwardSeed, &forwardFlow, &forwardSolverFlow);
         }
-        if (aChannel == 1) {
-            channelIndex[0].push_back(3);
+        if (backwardSolve) {
+            const bool prevCached = fetchOpticalFlowInput(srcPrev.get(), args.time - 1, params, backwardBounds, &prevImg, &prevMat, &prevMatBounds, &prevKey);
+            const int level = opticalFlowProxyLevel( params, rectSize(backwardBounds) );
+            if ( forwardSolve && equalRects(forwardBounds, backwardBounds) ) {
+                refBackward = refForward;
+            } else {
+                proxyOpticalFlowInput(refKey, refCached, refMat, refMatBounds, backwardBounds, level, &refBackward);
+            }
+            proxyOpticalFlowInput(prevKey, prevCached, prevMat, prevMatBounds, backwardBounds, level, &prevProxy);
+            if (warmStart) {
+                makeFlowSeedKey(params, -1, backwardBounds, args.renderScale, &backwardSeedKey);
+                _flowSeeds.get(backwardSeedKey, args.time, &backwardSeed);
+            }
+            processor.addJob(refBackward, prevProxy, rectSize(backwardBounds), backwardSeed, &backwardFlow, &backwardSolverFlow);
         }
 
-        if (rChannel == 2) {
-            channelIndex[1].push_back(0);
-        }
-        if (gChannel == 2) {
-            channelIndex[1].push_back(1);
-        }
-        if (bChannel == 2) {
-            channelIndex[1].push_back(2);
+        // the prefetched frame is converted while the flows are solved
+        FramePrefetchTask prefetchTask(this, srcPrefetch.get(), prefetchTime, params);
+        if ( srcPrefetch.get() && processor.canRunSideTask() ) {
+            processor.setSideTask(&prefetchTask);
+            prefetchConverted = true;
         }
-        if (aChannel == 2) {
-            channelIndex[1].push_back(3);
-        }
-
-        calcOpticalFlow( srcRef.get(), srcOther.get(), args.renderScale, args.renderWindow, channelIndex, method, dst.get() );
-    }
 
-    if (backwardNeeded) {
-        //Other image for "backward" optical flow computation
-        std::auto_ptr<const OFX::Image> srcOther((_srcClip && _srcClip->isConnected()) ?
-                                                 _srcClip->fetchImage(args.time-1) : 0);
-        if ( !srcOther.get() ) {
-            OFX::throwSuiteStatusException(kOfxStatFailed);
-        }
+        // both directions are solved concurrently
+        processor.process();
 
-        std::vector<int> channelIndex[2];
-        channelIndex[0] = std::vector<int>();
-        channelIndex[1] = std::vector<int>();
-        if (rChannel == 3) {
-            channelIndex[0].push_back(0);
-        }
-        if (gChannel == 3) {
-            channelIndex[0].push_back(1);
-        }
-        if (bChannel == 3) {
-            channelIndex[0].push_back(2);
+        if (warmStart && forwardSolve) {
+            _flowSeeds.insert(forwardSeedKey, args.time, forwardSolverFlow);
         }
-        if (aChannel == 3) {
-            channelIndex[0].push_back(3);
+        if (warmStart && backwardSolve) {
+            _flowSeeds.insert(backwardSeedKey, args.time, backwardSolverFlow);
         }
 
-        if (rChannel == 4) {
-            channelIndex[1].push_back(0);
+        // a flow solved from a seed depends on the frames rendered before, which the key does not hold:
+        // only the flows solved from zero are cached
+        if (forwardSolve && forwardCacheable && forwardSeed.empty()) {
+            _flowCache.insert( forwardKey, forwardFlow, matBytes(forwardFlow) );
         }
-        if (gChannel == 4) {
-            channelIndex[1].push_back(1);
-        }
-        if (bChannel == 4) {
-            channelIndex[1].push_back(2);
-        }
-        if (aChannel == 4) {
-            channelIndex[1].push_back(3);
+        if (backwardSolve && backwardCacheable && backwardSeed.empty()) {
+            _flowCache.insert( backwardKey, backwardFlow, matBytes(backwardFlow) );
         }
+    }
 
-        calcOpticalFlow( srcRef.get(), srcOther.get(), args.renderScale, args.renderWindow, channelIndex, method, dst.get() );
+    if ( srcPrefetch.get() && !prefetchConverted ) {
+        // the prefetched frame was declared in getFramesNeeded, but no thread was left to convert it
+        prefetchOpticalFlowInput(srcPrefetch.get(), prefetchTime, params);
     }
-    
+
+    writeOpticalFlow( forwardFlow, forwardBounds, backwardFlow, backwardBounds, channels, args.renderScale, args.renderWindow, dst.get() );
 } // render
 
+void
+VectorGeneratorPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                            OFX::RegionOfInterestSetter &rois)
+{
+    if (!_srcClip) {
+        return;
+    }
+    OpticalFlowParams params;
+    getOpticalFlowParams(args.time, args.renderScale, &params);
+
+    // the halo is in pixels at the render scale, convert it to canonical coordinates
+    const double halo = opticalFlowHalo(params);
+    const double par = _srcClip->getPixelAspectRatio();
+    OfxRectD roi = args.regionOfInterest;
+    roi.x1 -= halo * par / args.renderScale.x;
+    roi.x2 += halo * par / args.renderScale.x;
+    roi.y1 -= halo / args.renderScale.y;
+    roi.y2 += halo / args.renderScale.y;
+    rois.setRegionOfInterest(*_srcClip, roi);
+}
+
+void
+VectorGeneratorPlugin::purgeCaches()
+{
+    _flowCache.clear();
+    _flowSeeds.clear();
+    _frameCache.clear();
+    _tvl1Pool.clear();
+    GenericOpenCVPlugin::purgeCaches();
+}
+
 void
 VectorGeneratorPlugin::updateVisibility(OpticalFlowMethodEnum method)
 {
@@ -652,24 +2614,80 @@ VectorGeneratorPlugin::updateVisibility(OpticalFlowMethodEnum method)
     _blockSize->setIsSecret(method != eOpticalFlowSimpleFlow);
     _maxFlow->setIsSecret(method != eOpticalFlowSimpleFlow);
 #endif
-    
+
     _tau->setIsSecret(method != eOpticalFlowDualTVL1);
     _lambda->setIsSecret(method != eOpticalFlowDualTVL1);
     _theta->setIsSecret(method != eOpticalFlowDualTVL1);
     _nScales->setIsSecret(method != eOpticalFlowDualTVL1);
     _warps->setIsSecret(method != eOpticalFlowDualTVL1);
     _epsilon->setIsSecret(method != eOpticalFlowDualTVL1);
+
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+    _disPreset->setIsSecret(method != eOpticalFlowDIS);
+    _patchSize->setIsSecret(method != eOpticalFlowDIS);
+    _patchStride->setIsSecret(method != eOpticalFlowDIS);
+#endif
+
+    _workingSpace->setIsSecret( !supportsFloatInput(method) );
+    _warmStart->setIsSecret( !supportsInitialFlow(method) );
+    _warmLevels->setIsSecret(method != eOpticalFlowFarneback);
+    _warmIterations->setIsSecret(method != eOpticalFlowFarneback);
+}
+
+// show the params of the selected method, and report the methods that were not compiled
+void
+VectorGeneratorPlugin::updateMethod()
+{
+    int method_i;
+
+    _method->getValue(method_i);
+    const OpticalFlowMethodEnum method = methodFromOption(method_i);
+    updateVisibility(method);
+    if ( isMethodAvailable(method) ) {
+        clearPersistentMessage();
+    } else {
+        setPersistentMessage(OFX::Message::eMessageError, "", "The selected method was not available when the plugin was compiled");
+    }
 }
 
 void
 VectorGeneratorPlugin::changedParam(const InstanceChangedArgs &args, const std::string &paramName)
 {
     if (paramName == kParamMethod) {
-        int method_i;
-        _method->getValue(method_i);
-        OpticalFlowMethodEnum method = (OpticalFlowMethodEnum)method_i;
-        updateVisibility(method);
+        updateMethod();
+    }
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+    else if ( (paramName == kParamDISPreset) && (args.reason == eChangeUserEdit) ) {
+        // the preset sets the patch parameters, which can then be tuned
+        int disPreset_i;
+        _disPreset->getValue(disPreset_i);
+        if ( (disPreset_i >= (int)eDISPresetUltrafast) && (disPreset_i <= (int)eDISPresetMedium) ) {
+            _patchSize->setValue(gDISPresetPatchSize[disPreset_i]);
+            _patchStride->setValue(gDISPresetPatchStride[disPreset_i]);
+        }
+    }
+#endif
+}
+
+bool
+VectorGeneratorPlugin::getPrefetchTime(double time,
+                                       bool forwardNeeded,
+                                       bool backwardNeeded,
+                                       double* prefetchTime)
+{
+    bool prefetch;
+    _prefetch->getValueAtTime(time, prefetch);
+    if ( !prefetch || !_srcClip || !_srcClip->isConnected() ) {
+        return false;
     }
+    // the conversion needs a thread of its own besides the flows solved by the render
+    if ( OFX::MultiThread::getNumCPUs() <= (unsigned int)forwardNeeded + (unsigned int)backwardNeeded ) {
+        return false;
+    }
+    // t+2 for the forward flow, else t+1
+    *prefetchTime = time + (forwardNeeded ? 2 : 1);
+
+    return *prefetchTime <= _srcClip->getFrameRange().max;
 }
 
 void
@@ -690,6 +2708,11 @@ VectorGeneratorPlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
         OfxRangeD range;
         range.min = time - (int)backwardNeeded;
         range.max = time + (int)forwardNeeded;
+        double prefetchTime;
+        if ( getPrefetchTime(time, forwardNeeded, backwardNeeded, &prefetchTime) ) {
+            // the frame fetched for the next render, see render
+            range.max = prefetchTime;
+        }
         frames.setFramesNeeded(*_srcClip, range);
     }
 }
@@ -786,12 +2809,37 @@ VectorGeneratorPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamMethod);
         param->setLabels(kParamMethodLabel, kParamMethodLabel, kParamMethodLabel);
         param->setHint(kParamMethodHint);
+        // in the order of OpticalFlowMethodEnum
         param->appendOption("Farneback");
-#ifdef VECTOR_GENERATOR_WITH_SIMPLE_FLOW
         param->appendOption("Simple flow");
-#endif
         param->appendOption("Dual TV L1");
-        param->setDefault((int)defaultMethod);
+        param->appendOption("DIS", "Dense Inverse Search: fast dense flow, for interactive previews.");
+        param->setDefault( (int)defaultMethod );
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamFlowQuality);
+        param->setLabels(kParamFlowQualityLabel, kParamFlowQualityLabel, kParamFlowQualityLabel);
+        param->setHint(kParamFlowQualityHint);
+        param->appendOption(kParamFlowQualityOptionFull, kParamFlowQualityOptionFullHint);
+        param->appendOption(kParamFlowQualityOptionHalf, kParamFlowQualityOptionHalfHint);
+        param->appendOption(kParamFlowQualityOptionQuarter, kParamFlowQualityOptionQuarterHint);
+        param->appendOption(kParamFlowQualityOptionEighth, kParamFlowQualityOptionEighthHint);
+        param->setDefault( (int)eFlowQualityFull );
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamWorkingSpace);
+        param->setLabels(kParamWorkingSpaceLabel, kParamWorkingSpaceLabel, kParamWorkingSpaceLabel);
+        param->setHint(kParamWorkingSpaceHint);
+        param->appendOption(kParamWorkingSpaceOptionSRGB8, kParamWorkingSpaceOptionSRGB8Hint);
+        param->appendOption(kParamWorkingSpaceOptionLinear, kParamWorkingSpaceOptionLinearHint);
+        param->appendOption(kParamWorkingSpaceOptionLog, kParamWorkingSpaceOptionLogHint);
+        param->setDefault( (int)eWorkingSpaceSRGB8 );
         param->setAnimates(false);
         page->addChild(*param);
     }
@@ -801,6 +2849,8 @@ VectorGeneratorPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         IntParamDescriptor *param = desc.defineIntParam(kParamLevels);
         param->setLabels(kParamLevelsLabel, kParamLevelsLabel, kParamLevelsLabel);
         param->setHint(kParamLevelsHint);
+        param->setRange(1, 10);
+        param->setDisplayRange(1, 5);
         param->setDefault(3);
         param->setAnimates(true);
         page->addChild(*param);
@@ -842,6 +2892,8 @@ VectorGeneratorPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         IntParamDescriptor *param = desc.defineIntParam(kParamLayers);
         param->setLabels(kParamLayersLabel, kParamLayersLabel, kParamLayersLabel);
         param->setHint(kParamLayersHint);
+        param->setRange(1, 10);
+        param->setDisplayRange(1, 5);
         param->setDefault(3);
         param->setAnimates(true);
         page->addChild(*param);
@@ -904,6 +2956,8 @@ VectorGeneratorPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         IntParamDescriptor *param = desc.defineIntParam(kParamNScales);
         param->setLabels(kParamNScalesLabel, kParamNScalesLabel, kParamNScalesLabel);
         param->setHint(kParamNScalesHint);
+        param->setRange(1, 10);
+        param->setDisplayRange(1, 5);
         param->setDefault(5);
         param->setAnimates(true);
         page->addChild(*param);
@@ -927,6 +2981,96 @@ VectorGeneratorPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         param->setAnimates(true);
         page->addChild(*param);
     }
+
+#ifdef VECTOR_GENERATOR_WITH_DIS_FLOW
+    //DIS
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamDISPreset);
+        param->setLabels(kParamDISPresetLabel, kParamDISPresetLabel, kParamDISPresetLabel);
+        param->setHint(kParamDISPresetHint);
+        param->appendOption(kParamDISPresetOptionUltrafast, kParamDISPresetOptionUltrafastHint);
+        param->appendOption(kParamDISPresetOptionFast, kParamDISPresetOptionFastHint);
+        param->appendOption(kParamDISPresetOptionMedium, kParamDISPresetOptionMediumHint);
+        param->setDefault( (int)eDISPresetFast );
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    //DIS
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamPatchSize);
+        param->setLabels(kParamPatchSizeLabel, kParamPatchSizeLabel, kParamPatchSizeLabel);
+        param->setHint(kParamPatchSizeHint);
+        param->setRange(2, 64);
+        param->setDisplayRange(4, 32);
+        param->setDefault(gDISPresetPatchSize[eDISPresetFast]);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    //DIS
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamPatchStride);
+        param->setLabels(kParamPatchStrideLabel, kParamPatchStrideLabel, kParamPatchStrideLabel);
+        param->setHint(kParamPatchStrideHint);
+        param->setRange(1, 64);
+        param->setDisplayRange(1, 16);
+        param->setDefault(gDISPresetPatchStride[eDISPresetFast]);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+#endif
+
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamWarmStart);
+        param->setLabels(kParamWarmStartLabel, kParamWarmStartLabel, kParamWarmStartLabel);
+        param->setHint(kParamWarmStartHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    //Farneback
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamWarmLevels);
+        param->setLabels(kParamWarmLevelsLabel, kParamWarmLevelsLabel, kParamWarmLevelsLabel);
+        param->setHint(kParamWarmLevelsHint);
+        param->setRange(1, 10);
+        param->setDisplayRange(1, 5);
+        param->setDefault(1);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    //Farneback
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamWarmIterations);
+        param->setLabels(kParamWarmIterationsLabel, kParamWarmIterationsLabel, kParamWarmIterationsLabel);
+        param->setHint(kParamWarmIterationsHint);
+        param->setRange(1, 100);
+        param->setDisplayRange(1, 15);
+        param->setDefault(5);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamDeriveBackward);
+        param->setLabels(kParamDeriveBackwardLabel, kParamDeriveBackwardLabel, kParamDeriveBackwardLabel);
+        param->setHint(kParamDeriveBackwardHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamPrefetch);
+        param->setLabels(kParamPrefetchLabel, kParamPrefetchLabel, kParamPrefetchLabel);
+        param->setHint(kParamPrefetchHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
 } // describeInContext
 
 OFX::ImageEffect*
@@ -72,6 +72,8 @@
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <algorithm>
+#include <vector>
 #include "cv.h"
 #if (CV_MAJOR_VERSION != 2) || ((CV_MAJOR_VERSION == 2) && (CV_MINOR_VERSION > 1))
 #include "opencv2/photo/photo_c.h"
@@ -82,6 +84,11 @@
 #include "ofxPixels.h"
 #include "opencv2fx.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define INPAINT_WITH_SSE2
+#include <emmintrin.h>
+#endif
+
 
 #if CV_MAJOR_VERSION >= 3
 #error "This code won't work with OpenCV3 since it uses the - now gone for good - opencv-legacy module"
@@ -91,6 +98,17 @@
 #define DILATION "threshold2"
 #define INPAINT_NOISE "inpaintnoise"
 #define BLOCK_SIZE 1000
+// the fixed point luminance of cvCvtColor(CV_RGBA2GRAY): (R2Y*r + G2Y*g + B2Y*b + 2^13) >> 14.
+// The gray value is 0, and the pixel is masked, when R2Y*r + G2Y*g + B2Y*b is below BLACK_LIMIT.
+#define R2Y 4899
+#define G2Y 9617
+#define B2Y 1868
+#define BLACK_LIMIT 8192
+// the noise is drawn for cells of NOISE_CELL x NOISE_CELL pixels, and is at most NOISE_AMPLITUDE when the noise parameter is 1
+#define NOISE_CELL_SHIFT 1
+#define NOISE_AMPLITUDE 5.
+// the smallest band a mask region is cut into for the render threads
+#define MIN_BAND_HEIGHT 64
 
 // pointers64 to various bits of the host
 OfxHost               *gHost;
@@ -108,6 +126,8 @@ struct MyInstanceData {
   OfxParamHandle threshold2;
   OfxParamHandle inpaintNoise;
   int isGeneralEffect;
+  // the mask and working images, kept from one render to the next
+  ScratchImageCache *scratch;
 };
 
 // Convinience wrapper to get private data 
@@ -157,6 +177,7 @@ createInstance( OfxImageEffectHandle effect)
   myData->threshold1 = 0;
   myData->threshold2 = 0;
   myData->inpaintNoise = 0;
+  myData->scratch = new ScratchImageCache(gThreadHost);
 
   // cache away out param handles
   stat = gParamHost->paramGetHandle(paramSet, INPAINT_RADIUS, &myData->threshold1, 0);
@@ -183,12 +204,26 @@ destroyInstance( OfxImageEffectHandle  effect)
 
   // and delete it
   if(myData) {
+    delete myData->scratch;
     delete myData;
   }
 
   return kOfxStatOK;
 }
 
+// release the scratch images
+static OfxStatus
+purgeCaches( OfxImageEffectHandle  effect)
+{
+  MyInstanceData *myData = getMyInstanceData(effect);
+
+  if(myData) {
+    myData->scratch->purge();
+  }
+
+  return kOfxStatOK;
+}
+
 
 
 
@@ -196,7 +231,7 @@ destroyInstance( OfxImageEffectHandle  effect)
 inline OfxRGBAColourB *
 pixelAddress(OfxRGBAColourB *img, OfxRectI rect, int x, int y, int bytesPerLine)
 {  
-  if(x < rect.x1 || x >= rect.x2 || y < rect.y1 || y > rect.y2)
+  if(x < rect.x1 || x >= rect.x2 || y < rect.y1 || y >= rect.y2)
     return 0;
   OfxRGBAColourB *pix = (OfxRGBAColourB *) (((char *) img) + (y - rect.y1) * bytesPerLine);
   pix += x - rect.x1;  
@@ -205,6 +240,322 @@ pixelAddress(OfxRGBAColourB *img, OfxRectI rect, int x, int y, int bytesPerLine)
 
 
 
+// build the RGB working image and the mask from the RGBA source in a single pass. This gives the same
+// images as cvCvtColor(CV_RGBA2RGB), and cvCvtColor(CV_RGBA2GRAY) followed by cvThreshold(0, 255, CV_THRESH_BINARY_INV).
+static void
+splitSource(const IplImage *imgSrc, IplImage *rgb, IplImage *mask)
+{
+  for(int y = 0; y < imgSrc->height; y++) {
+    const unsigned char *srcPix = (const unsigned char*)(imgSrc->imageData + y * imgSrc->widthStep);
+    unsigned char *rgbPix = (unsigned char*)(rgb->imageData + y * rgb->widthStep);
+    unsigned char *maskPix = (unsigned char*)(mask->imageData + y * mask->widthStep);
+    int x = 0;
+
+#ifdef INPAINT_WITH_SSE2
+    // 8 pixels at a time: the weighted sums of 2 pixels come out of each _mm_madd_epi16 as (R2Y*r + G2Y*g, B2Y*b)
+    const __m128i coeffs = _mm_setr_epi16(R2Y, G2Y, B2Y, 0, R2Y, G2Y, B2Y, 0);
+    const __m128i limit = _mm_set1_epi16(BLACK_LIMIT);
+    const __m128i zero = _mm_setzero_si128();
+    for(; x + 8 <= imgSrc->width; x += 8) {
+      __m128i sums[2];
+      for(int i = 0; i < 2; i++) {
+	__m128i pixels = _mm_loadu_si128((const __m128i*)(srcPix + 16 * i));
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coeffs);
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coeffs);
+	__m128 rg = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 b = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+	sums[i] = _mm_add_epi32(_mm_castps_si128(rg), _mm_castps_si128(b));
+      }
+      // the sums above 32767 saturate, which does not change the comparison
+      __m128i black = _mm_cmplt_epi16(_mm_packs_epi32(sums[0], sums[1]), limit);
+      _mm_storel_epi64((__m128i*)maskPix, _mm_packs_epi16(black, black));
+
+      for(int i = 0; i < 8; i++) {
+	rgbPix[0] = srcPix[0];
+	rgbPix[1] = srcPix[1];
+	rgbPix[2] = srcPix[2];
+	rgbPix += 3;
+	srcPix += 4;
+      }
+      maskPix += 8;
+    }
+#endif
+
+    for(; x < imgSrc->width; x++) {
+      int sum = R2Y * srcPix[0] + G2Y * srcPix[1] + B2Y * srcPix[2];
+      *maskPix = (sum < BLACK_LIMIT) ? 255 : 0;
+      rgbPix[0] = srcPix[0];
+      rgbPix[1] = srcPix[1];
+      rgbPix[2] = srcPix[2];
+      rgbPix += 3;
+      srcPix += 4;
+      maskPix++;
+    }
+  }
+}
+
+// the margin of known pixels around the mask that the inpainting of a given radius reads
+static inline int
+inpaintMargin(double radius)
+{
+  return (int)ceil(radius) + 1;
+}
+
+// true if the two rectangles share at least one pixel
+static bool
+rectsOverlap(const CvRect &a, const CvRect &b)
+{
+  return (a.x < b.x + b.width) && (b.x < a.x + a.width) && (a.y < b.y + b.height) && (b.y < a.y + a.height);
+}
+
+static bool
+rectIsLeftOf(const CvRect &a, const CvRect &b)
+{
+  return a.x < b.x;
+}
+
+// the bounding boxes of the connected regions of the mask, grown by margin and clipped to the image.
+// Boxes that overlap are merged, so that each box can be inpainted independently.
+static void
+maskRegions(ScratchImageCache &scratch, const IplImage *mask, int margin, std::vector<CvRect> &regions)
+{
+  // growing the mask by margin joins the regions closer than that, and gives their grown boxes, already clipped.
+  // cvFindContours modifies its input, so it always works on a copy.
+  ScratchImage contourImage(scratch, cvGetSize(mask), IPL_DEPTH_8U, 1);
+  IplImage *contourMask = contourImage.get();
+  if(margin > 0) {
+    IplConvKernel *element = cvCreateStructuringElementEx(2 * margin + 1, 2 * margin + 1, margin, margin, CV_SHAPE_RECT, NULL);
+    cvDilate(mask, contourMask, element, 1);
+    cvReleaseStructuringElement(&element);
+  } else {
+    cvCopy(mask, contourMask);
+  }
+  CvMemStorage *storage = cvCreateMemStorage(0);
+  CvSeq *contours = 0;
+  cvFindContours(contourMask, storage, &contours, sizeof(CvContour), CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, cvPoint(0, 0));
+
+  std::vector<CvRect> boxes;
+  for(CvSeq *c = contours; c; c = c->h_next) {
+    boxes.push_back(cvBoundingRect(c, 0));
+  }
+  cvReleaseMemStorage(&storage);
+
+  // the boxes of separate regions may still overlap: merge them in a single sweep from left to right,
+  // keeping the merged boxes pairwise disjoint. A box grows into each kept box at most once.
+  std::sort(boxes.begin(), boxes.end(), rectIsLeftOf);
+  for(size_t i = 0; i < boxes.size(); i++) {
+    CvRect r = boxes[i];
+    bool grown = true;
+    while(grown) {
+      grown = false;
+      for(size_t j = 0; j < regions.size(); ) {
+	if(rectsOverlap(r, regions[j])) {
+	  int x1 = std::min(r.x, regions[j].x);
+	  int y1 = std::min(r.y, regions[j].y);
+	  int x2 = std::max(r.x + r.width, regions[j].x + regions[j].width);
+	  int y2 = std::max(r.y + r.height, regions[j].y + regions[j].height);
+	  r = cvRect(x1, y1, x2 - x1, y2 - y1);
+	  regions[j] = regions.back();
+	  regions.pop_back();
+	  grown = true;
+	} else {
+	  j++;
+	}
+      }
+    }
+    regions.push_back(r);
+  }
+}
+
+// a part of the image that is inpainted on its own: the whole area is inpainted, but only the rows
+// [writeY1, writeY2) are written to the output (all coordinates are relative to the source image)
+struct InpaintTile {
+  CvRect area;
+  int writeY1;
+  int writeY2;
+};
+
+static bool
+tileIsLarger(const InpaintTile &a, const InpaintTile &b)
+{
+  return a.area.width * a.area.height > b.area.width * b.area.height;
+}
+
+// cut the mask regions into tiles, so that there are enough jobs for all the threads. A region is cut in
+// horizontal bands, each inpainted with a halo of rows above and below it.
+static void
+maskTiles(const std::vector<CvRect> &regions, unsigned int nThreads, int halo, std::vector<InpaintTile> &tiles)
+{
+  unsigned int bandsPerRegion = 1;
+  if(!regions.empty() && regions.size() < nThreads) {
+    bandsPerRegion = (nThreads + regions.size() - 1) / regions.size();
+  }
+
+  for(size_t i = 0; i < regions.size(); i++) {
+    const CvRect &r = regions[i];
+    int bandHeight = std::max(MIN_BAND_HEIGHT, (int)((r.height + bandsPerRegion - 1) / bandsPerRegion));
+    for(int y = r.y; y < r.y + r.height; y += bandHeight) {
+      InpaintTile tile;
+      tile.writeY1 = y;
+      tile.writeY2 = std::min(y + bandHeight, r.y + r.height);
+      int y1 = std::max(r.y, tile.writeY1 - halo);
+      int y2 = std::min(r.y + r.height, tile.writeY2 + halo);
+      tile.area = cvRect(r.x, y1, r.width, y2 - y1);
+      tiles.push_back(tile);
+    }
+  }
+
+  // the largest tiles go first, to balance the threads
+  std::stable_sort(tiles.begin(), tiles.end(), tileIsLarger);
+}
+
+// a hash of the pixel coordinates and the frame, from which the noise of a pixel is drawn.
+// It only depends on its arguments, so that the noise is the same whatever the tiles and threads.
+static inline unsigned int
+noiseHash(int x, int y, unsigned int frame)
+{
+  unsigned int h = (unsigned int)x * 0x8da6b343u ^ (unsigned int)y * 0xd8163841u ^ frame * 0xcb1ab31fu;
+  // the finalizer of MurmurHash3
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+// everything the render threads need
+struct InpaintJob {
+  OfxImageEffectHandle instance;
+  IplImage *rgb;
+  IplImage *mask;
+  const std::vector<InpaintTile> *tiles;
+  double radius;
+  double noise;
+  OfxRGBAColourB *dst;
+  OfxRectI dstRect;
+  int dstRowBytes;
+  OfxRectI srcRect;
+  OfxRectI renderWindow;
+  unsigned int frame;
+  ScratchImageCache *scratch;
+  volatile bool failed;
+};
+
+// inpaint the masked pixels of one tile of the source, and write the tile to the output
+static void
+inpaintTile(const InpaintJob &job, const InpaintTile &tile)
+{
+  const CvRect &area = tile.area;
+  ScratchImage scratch1(*job.scratch, cvSize(area.width, area.height), IPL_DEPTH_8U, 3);
+  IplImage *image1 = scratch1.get();
+
+  // the working image and mask are shared by the threads, so use sub-matrix headers rather than setting their ROI
+  CvMat rgbArea, maskArea;
+  cvGetSubRect(job.rgb, &rgbArea, area);
+  cvGetSubRect(job.mask, &maskArea, area);
+
+  int flag = CV_INPAINT_TELEA;
+
+  // perform the inpaint
+  cvInpaint(&rgbArea,
+	    &maskArea,
+	    image1,
+	    job.radius,
+	    flag);
+
+  // the noise is (hash - 512) * noiseScale / 2^17, for a 10 bit hash
+  int noiseScale = (int)(job.noise * NOISE_AMPLITUDE * 256. + 0.5);
+
+  // the part of the tile that is written, in image coordinates
+  const OfxRectI &srcRect = job.srcRect;
+  int x1 = std::max(srcRect.x1 + area.x, std::max(job.renderWindow.x1, job.dstRect.x1));
+  int x2 = std::min(srcRect.x1 + area.x + area.width, std::min(job.renderWindow.x2, job.dstRect.x2));
+  int y1 = std::max(srcRect.y1 + tile.writeY1, std::max(job.renderWindow.y1, job.dstRect.y1));
+  int y2 = std::min(srcRect.y1 + tile.writeY2, std::min(job.renderWindow.y2, job.dstRect.y2));
+  if(x1 >= x2) return;
+
+  // the noise of a row, split in the values to add and to subtract, for the R, G and B bytes of each pixel
+  std::vector<unsigned char> noiseUp, noiseDown;
+  if(noiseScale > 0) {
+    noiseUp.resize(4 * (x2 - x1));
+    noiseDown.resize(4 * (x2 - x1));
+  }
+
+  for(int iy = y1; iy < y2; iy++) {
+    // row and column of the first written pixel in the tile
+    int y = iy - srcRect.y1 - area.y;
+    int x0 = x1 - srcRect.x1 - area.x;
+    OfxRGBAColourB *dstPix = pixelAddress(job.dst, job.dstRect, x1, iy, job.dstRowBytes);
+    if(!dstPix) continue;
+    unsigned char *srcPix = (unsigned char*)(image1->imageData + y * image1->widthStep) + 3 * x0;
+
+    for(int x = x1; x < x2; x++) {
+      dstPix->r = srcPix[0];
+      dstPix->g = srcPix[1];
+      dstPix->b = srcPix[2];
+      dstPix->a = 255;
+
+      dstPix++;
+      srcPix=srcPix+3;
+    }
+
+    if(noiseScale <= 0) continue;
+
+    // fake camera noise on the inpainted pixels
+    unsigned char *maskP = (unsigned char*)(job.mask->imageData + (area.y + y) * job.mask->widthStep + area.x + x0);
+    bool noisy = false;
+    for(int x = x1; x < x2; x++) {
+      int a = 0;
+      if(maskP[x - x1]) {
+	int h = (int)(noiseHash(x >> NOISE_CELL_SHIFT, iy >> NOISE_CELL_SHIFT, job.frame) & 0x3ff);
+	a = ((h - 512) * noiseScale + (1 << 16)) >> 17;
+	noisy = noisy || (a != 0);
+      }
+      unsigned char up = (unsigned char)std::max(a, 0);
+      unsigned char down = (unsigned char)std::max(-a, 0);
+      unsigned char *u = &noiseUp[4 * (x - x1)];
+      unsigned char *d = &noiseDown[4 * (x - x1)];
+      u[0] = u[1] = u[2] = up;
+      d[0] = d[1] = d[2] = down;
+      u[3] = d[3] = 0;
+    }
+    if(!noisy) continue;
+
+    unsigned char *dstBytes = (unsigned char*)pixelAddress(job.dst, job.dstRect, x1, iy, job.dstRowBytes);
+    int n = 4 * (x2 - x1);
+    int i = 0;
+#ifdef INPAINT_WITH_SSE2
+    for(; i + 16 <= n; i += 16) {
+      __m128i pixels = _mm_loadu_si128((const __m128i*)(dstBytes + i));
+      pixels = _mm_adds_epu8(pixels, _mm_loadu_si128((const __m128i*)&noiseUp[i]));
+      pixels = _mm_subs_epu8(pixels, _mm_loadu_si128((const __m128i*)&noiseDown[i]));
+      _mm_storeu_si128((__m128i*)(dstBytes + i), pixels);
+    }
+#endif
+    for(; i < n; i++) {
+      dstBytes[i] = (unsigned char)clamp(dstBytes[i] + noiseUp[i] - noiseDown[i], 0, 255);
+    }
+  }
+}
+
+// the function run by each thread of the multithread suite. The tiles are dealt out in turn to the threads,
+// and since the tiles write disjoint parts of the output, they need no locking.
+static void
+inpaintThread(unsigned int threadIndex, unsigned int threadMax, void *customArg)
+{
+  InpaintJob *job = (InpaintJob *) customArg;
+  try {
+    for(size_t i = threadIndex; i < job->tiles->size(); i += threadMax) {
+      if(job->failed || gEffectHost->abort(job->instance)) break;
+      inpaintTile(*job, (*job->tiles)[i]);
+    }
+  } catch (...) {
+    // exceptions must not escape to the host thread
+    job->failed = true;
+  }
+}
+
 // the process code  that the host sees
 static OfxStatus render(OfxImageEffectHandle instance,
                         OfxPropertySetHandle inArgs,
@@ -283,6 +634,13 @@ static OfxStatus render(OfxImageEffectHandle instance,
     stat = gParamHost->paramGetValueAtTime(myData->inpaintNoise, time, &ng);
     OFX::throwSuiteStatusException(stat);
 
+    // the radius and dilation are in full resolution pixels
+    OfxPointD renderScale;
+    stat = gPropHost->propGetDoubleN(inArgs, kOfxImageEffectPropRenderScale, 2, &renderScale.x);
+    OFX::throwSuiteStatusException(stat);
+    t1 *= renderScale.x;
+    int dilation = (int)floor(t2 * renderScale.x + 0.5);
+
     // cast data pointers to 8 bit RGBA
     OfxRGBAColourB *dst = (OfxRGBAColourB *) dstPtr;
 
@@ -295,75 +653,90 @@ static OfxStatus render(OfxImageEffectHandle instance,
 
     imgSrc->imageData = (char*) srcPtr;
     imgSrc->widthStep = srcRowBytes;
+    imgSrc->imageSize = srcRowBytes * imageSize.height;
 
-    IplImage *image0 = cvCreateImage( imageSize, IPL_DEPTH_8U, 3);
-    IplImage *image1 = cvCreateImage( imageSize, IPL_DEPTH_8U, 3);
-    IplImage *mask = cvCreateImage( imageSize, IPL_DEPTH_8U, 1);
-
-    cvCvtColor( imgSrc , image0, CV_RGBA2RGB );
-    cvCvtColor( imgSrc , image1, CV_RGBA2RGB );
-    cvCvtColor( imgSrc , mask, CV_RGBA2GRAY );
-
-    cvThreshold( mask , mask, 0, 255, CV_THRESH_BINARY_INV );
-
-    if (t2>0) cvDilate(mask,mask,NULL,(int)t2);
+    // the RGB working image and the mask of the black pixels, in one pass over the source
+    ScratchImage rgbImage(*myData->scratch, imageSize, IPL_DEPTH_8U, 3);
+    ScratchImage maskImage(*myData->scratch, imageSize, IPL_DEPTH_8U, 1);
+    IplImage *rgb = rgbImage.get();
+    IplImage *mask = maskImage.get();
 
-    int flag = CV_INPAINT_TELEA;
+    splitSource(imgSrc, rgb, mask);
 
-    // perform the inpaint
-    cvInpaint(image0,
-    	      mask,
-    	      image1,
-    	      t1,
-    	      flag);
+    if (dilation>0) cvDilate(mask,mask,NULL,dilation);
 
-    int noise_flag = (ng>0);
-    int noise_div = 1000;
-    if (noise_flag) {
-      noise_div=1/ng;
-    }
-
-    int rs=0;
-    for(int y = renderWindow.y1; y < (renderWindow.y1 + image1->height); y++) {
+    // the pixels outside of the mask are a straight copy
+    for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
         if(gEffectHost->abort(instance)) break;
 
 	OfxRGBAColourB *dstPix = pixelAddress(dst, dstRect, renderWindow.x1, y, dstRowBytes);
-	unsigned char *srcPix = (unsigned char*)(image1->imageData + y * image1->widthStep + renderWindow.x1);
-	unsigned char *maskP = (unsigned char*)(mask->imageData + y * mask->widthStep + renderWindow.x1);
-
-        for(int x = renderWindow.x1; x < (renderWindow.x1 + image1->width); x++) {
-
-	  if ((y%4)==0) srand(rs);
-	  int a=0;
-	  if (noise_flag) {
-	    if (maskP[0]>0) {
-	      // we add some noise
-	      if ((x%4)==0) {
-		// make noise a bit more low frequ
-		a=((rand()%10)-5)/noise_div;
-		rs=(rs+srcPix[0])%256;
-	      }
-	    }
+	if(!dstPix) continue;
+
+        for(int x = renderWindow.x1; x < renderWindow.x2; x++) {
+	  // the source may not cover the whole render window
+	  OfxRGBAColourB *srcPix = pixelAddress((OfxRGBAColourB *) srcPtr, srcRect, x, y, srcRowBytes);
+	  if(srcPix) {
+	    dstPix->r = srcPix->r;
+	    dstPix->g = srcPix->g;
+	    dstPix->b = srcPix->b;
+	    dstPix->a = 255;
+	  } else {
+	    dstPix->r = dstPix->g = dstPix->b = dstPix->a = 0;
 	  }
-	  
-	  dstPix->r = clamp(srcPix[0] + a,0,255);
-	  dstPix->g = clamp(srcPix[1] + a,0,255);
-	  dstPix->b = clamp(srcPix[2] + a,0,255);
-	  dstPix->a = 255;
 
 	  dstPix++;
-	  srcPix=srcPix+3;
-	  maskP++;
         }
     }
 
+    // each connected region of the mask is inpainted on its own, with the margin of known pixels that the inpainting reads
+    int margin = inpaintMargin(t1);
+    std::vector<CvRect> regions;
+    maskRegions(*myData->scratch, mask, margin, regions);
+
+    unsigned int nThreads = 1;
+    if(!gThreadHost || gThreadHost->multiThreadNumCPUs(&nThreads) != kOfxStatOK || nThreads < 1) {
+      nThreads = 1;
+    }
+
+    // the regions are cut in bands when there are fewer regions than threads
+    std::vector<InpaintTile> tiles;
+    maskTiles(regions, nThreads, margin + dilation, tiles);
+
+    InpaintJob job;
+    job.instance = instance;
+    job.rgb = rgb;
+    job.mask = mask;
+    job.tiles = &tiles;
+    job.radius = t1;
+    job.noise = ng;
+    job.dst = dst;
+    job.dstRect = dstRect;
+    job.dstRowBytes = dstRowBytes;
+    job.srcRect = srcRect;
+    job.renderWindow = renderWindow;
+    job.frame = (unsigned int)(int)floor(time + 0.5);
+    job.scratch = myData->scratch;
+    job.failed = false;
+
+    nThreads = std::min(nThreads, (unsigned int)tiles.size());
+    if(nThreads > 1) {
+      stat = gThreadHost->multiThread(inpaintThread, nThreads, &job);
+      if(stat != kOfxStatOK) {
+	// the host could not start the threads: do it all on this one
+	inpaintThread(0, 1, &job);
+      }
+    } else if(nThreads == 1) {
+      inpaintThread(0, 1, &job);
+    }
+
     // just release the header but not the image itself. That will be done later.
     cvReleaseImageHeader(&imgSrc);
-    // release the 2 images used for the inpaint function
-    cvReleaseImage(&image0);
-    cvReleaseImage(&image1);
-    // release the mask
-    cvReleaseImage(&mask);
+
+    if(job.failed) {
+      gEffectHost->clipReleaseImage(sourceImg);
+      gEffectHost->clipReleaseImage(outputImg);
+      return kOfxStatFailed;
+    }
 
     // we are finished with the source images so release them
     stat = gEffectHost->clipReleaseImage(sourceImg);
@@ -379,6 +752,56 @@ static OfxStatus render(OfxImageEffectHandle instance,
 
 
 
+// the source pixels needed to render a region: the region grown by the margin of the inpainting and the dilation
+// of the mask. Tiles are inpainted from the mask that falls inside that halo, so regions of the mask that are cut by
+// a tile edge may be filled slightly differently than in a full frame render.
+static OfxStatus
+getRegionsOfInterest(OfxImageEffectHandle instance,
+		     OfxPropertySetHandle inArgs,
+		     OfxPropertySetHandle outArgs)
+{
+  OfxTime time;
+  OfxRectD roi;
+  OfxStatus stat;
+
+  MyInstanceData *myData = getMyInstanceData(instance);
+
+  stat = gPropHost->propGetDouble(inArgs, kOfxPropTime, 0, &time);
+  OFX::throwSuiteStatusException(stat);
+  stat = gPropHost->propGetDoubleN(inArgs, kOfxImageEffectPropRegionOfInterest, 4, &roi.x1);
+  OFX::throwSuiteStatusException(stat);
+
+  double t1,t2;
+  stat = gParamHost->paramGetValueAtTime(myData->threshold1, time, &t1);
+  OFX::throwSuiteStatusException(stat);
+  stat = gParamHost->paramGetValueAtTime(myData->threshold2, time, &t2);
+  OFX::throwSuiteStatusException(stat);
+
+  // canonical coordinates are full resolution pixels, stretched horizontally by the pixel aspect ratio
+  OfxImageClipHandle sourceClip = 0;
+  stat = gEffectHost->clipGetHandle(instance, kOfxImageEffectSimpleSourceClipName, &sourceClip, 0);
+  OFX::throwSuiteStatusException(stat);
+  OfxPropertySetHandle sourceProps = 0;
+  stat = gEffectHost->clipGetPropertySet(sourceClip, &sourceProps);
+  OFX::throwSuiteStatusException(stat);
+  double par = 1.;
+  stat = gPropHost->propGetDouble(sourceProps, kOfxImagePropPixelAspectRatio, 0, &par);
+  if(stat != kOfxStatOK || par <= 0.) {
+    par = 1.;
+  }
+
+  double halo = inpaintMargin(t1) + ceil(t2);
+  roi.x1 -= halo * par;
+  roi.x2 += halo * par;
+  roi.y1 -= halo;
+  roi.y2 += halo;
+
+  stat = gPropHost->propSetDoubleN(outArgs, kOfxImageClipPropRoI "_" kOfxImageEffectSimpleSourceClipName, 4, &roi.x1);
+  OFX::throwSuiteStatusException(stat);
+
+  return kOfxStatOK;
+}
+
 //  describe the plugin in context
 static OfxStatus
 describeInContext( OfxImageEffectHandle  effect,  OfxPropertySetHandle inArgs)
@@ -498,11 +921,14 @@ describe(OfxImageEffectHandle effect)
   // set a few flags
   stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPluginPropSingleInstance, 0, int(false));
   OFX::throwSuiteStatusException(stat);
-  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPluginPropHostFrameThreading, 0, int(false));
+  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPluginPropHostFrameThreading, 0, int(true));
+  OFX::throwSuiteStatusException(stat);
+  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsMultiResolution, 0, int(true));
   OFX::throwSuiteStatusException(stat);
-  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsMultiResolution, 0, int(false));
+  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsTiles, 0, int(true));
   OFX::throwSuiteStatusException(stat);
-  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsTiles, 0, int(false));
+  // render only reads the instance data, so any number of renders may run at the same time
+  stat = gPropHost->propSetString(effectProps, kOfxImageEffectPluginRenderThreadSafety, 0, kOfxImageEffectRenderFullySafe);
   OFX::throwSuiteStatusException(stat);
   stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropTemporalClipAccess, 0, int(false));
   OFX::throwSuiteStatusException(stat);
@@ -546,10 +972,14 @@ pluginMain(const char *action,  const void *handle, OfxPropertySetHandle inArgs,
             return describeInContext(effect, inArgs);
         } else if(strcmp(action, kOfxImageEffectActionRender) == 0) {
             return render(effect, inArgs, outArgs);
+        } else if(strcmp(action, kOfxImageEffectActionGetRegionsOfInterest) == 0) {
+            return getRegionsOfInterest(effect, inArgs, outArgs);
         } else if(strcmp(action, kOfxActionCreateInstance) == 0) {
             return createInstance(effect);
         } else if(strcmp(action, kOfxActionDestroyInstance) == 0) {
             return destroyInstance(effect);
+        } else if(strcmp(action, kOfxActionPurgeCaches) == 0) {
+            return purgeCaches(effect);
         }
     } catch (const OFX::Exception::Suite &e) {
         std::cout << "OFX Plugin Suite error: " << e.what() << std::endl;
@@ -92,3 +92,107 @@ void defineDoubleParam( OfxPropertySuiteV1 *gPropHost,
   stat = gPropHost->propSetString(props, kOfxPropLabel, 0, label);
   OFX::throwSuiteStatusException(stat);
 }
+
+// the most idle images a cache keeps, and the most memory they may take
+#define SCRATCH_MAX_IDLE 32
+#define SCRATCH_MAX_IDLE_BYTES (256 * 1024 * 1024)
+
+ScratchImageCache::ScratchImageCache(OfxMultiThreadSuiteV1 *threadHost)
+  : _threadHost(threadHost)
+  , _lock(0)
+  , _idleBytes(0)
+{
+  OfxStatus stat = _threadHost->mutexCreate(&_lock, 0);
+  OFX::throwSuiteStatusException(stat);
+}
+
+ScratchImageCache::~ScratchImageCache()
+{
+  purge();
+  _threadHost->mutexDestroy(_lock);
+}
+
+IplImage *
+ScratchImageCache::acquire(CvSize size, int depth, int channels)
+{
+  IplImage *image = 0;
+  _threadHost->mutexLock(_lock);
+  // the smallest idle image that fits
+  size_t best = _idle.size();
+  for(size_t i = 0; i < _idle.size(); i++) {
+    IplImage *candidate = _idle[i];
+    if(candidate->depth == depth && candidate->nChannels == channels &&
+       candidate->width >= size.width && candidate->height >= size.height &&
+       (best == _idle.size() || candidate->width * candidate->height < _idle[best]->width * _idle[best]->height)) {
+      best = i;
+    }
+  }
+  if(best < _idle.size()) {
+    image = _idle[best];
+    _idle.erase(_idle.begin() + best);
+    _idleBytes -= image->imageSize;
+  }
+  _threadHost->mutexUnLock(_lock);
+
+  if(!image) {
+    image = cvCreateImage(size, depth, channels);
+  }
+  return image;
+}
+
+void
+ScratchImageCache::release(IplImage *image)
+{
+  if((size_t)image->imageSize > SCRATCH_MAX_IDLE_BYTES) {
+    cvReleaseImage(&image);
+    return;
+  }
+
+  // the least recently used images go first, until the idle images fit in both bounds
+  std::vector<IplImage*> evicted;
+  _threadHost->mutexLock(_lock);
+  _idle.push_back(image);
+  _idleBytes += image->imageSize;
+  size_t n = 0;
+  while(_idle.size() - n > SCRATCH_MAX_IDLE || _idleBytes > SCRATCH_MAX_IDLE_BYTES) {
+    _idleBytes -= _idle[n]->imageSize;
+    evicted.push_back(_idle[n]);
+    n++;
+  }
+  _idle.erase(_idle.begin(), _idle.begin() + n);
+  _threadHost->mutexUnLock(_lock);
+
+  for(size_t i = 0; i < evicted.size(); i++) {
+    cvReleaseImage(&evicted[i]);
+  }
+}
+
+void
+ScratchImageCache::purge()
+{
+  std::vector<IplImage*> idle;
+  _threadHost->mutexLock(_lock);
+  idle.swap(_idle);
+  _idleBytes = 0;
+  _threadHost->mutexUnLock(_lock);
+
+  for(size_t i = 0; i < idle.size(); i++) {
+    cvReleaseImage(&idle[i]);
+  }
+}
+
+ScratchImage::ScratchImage(ScratchImageCache &cache, CvSize size, int depth, int channels)
+  : _cache(cache)
+  , _image(cache.acquire(size, depth, channels))
+{
+  // a header on the top left part of the buffer
+  cvInitImageHeader(&_header, size, depth, channels);
+  _header.imageData = _image->imageData;
+  _header.widthStep = _image->widthStep;
+  _header.imageSize = _image->widthStep * size.height;
+}
+
+ScratchImage::~ScratchImage()
+{
+  _cache.release(_image);
+}
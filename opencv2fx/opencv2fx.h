@@ -7,6 +7,8 @@
 #include "ofxMultiThread.h"
 #include "ofxPixels.h"
 
+#include <vector>
+
 #define PLUGIN_GROUPING "Draw"
 
 // defines a new control for the plugin which controls a floating point variable
@@ -30,6 +32,50 @@ clamp(T v, int min, int max)
 }
 
 
+// scratch images kept across renders by an instance, so that the same buffers are reused from frame to frame.
+// It may be used by several render threads at once.
+class ScratchImageCache
+{
+ public:
+  ScratchImageCache(OfxMultiThreadSuiteV1 *threadHost);
+  ~ScratchImageCache();
+
+  // an idle image with the given depth and channels that is at least as large as size, or a new image
+  IplImage *acquire(CvSize size, int depth, int channels);
+
+  // give back an image returned by acquire. The idle images are bounded in number and in bytes.
+  void release(IplImage *image);
+
+  // release all the idle images
+  void purge();
+
+ private:
+  OfxMultiThreadSuiteV1 *_threadHost;
+  OfxMutexHandle _lock;
+  // the idle images, the least recently used first, and the bytes of their buffers
+  std::vector<IplImage*> _idle;
+  size_t _idleBytes;
+};
+
+// an image of exactly the given size, on a buffer taken from a ScratchImageCache for the lifetime of this object
+class ScratchImage
+{
+ public:
+  ScratchImage(ScratchImageCache &cache, CvSize size, int depth, int channels);
+  ~ScratchImage();
+
+  IplImage *get() { return &_header; }
+
+ private:
+  ScratchImageCache &_cache;
+  IplImage *_image;
+  IplImage _header;
+
+  // not copyable
+  ScratchImage(const ScratchImage &);
+  ScratchImage &operator=(const ScratchImage &);
+};
+
 /** @brief The core 'OFX Support' namespace, used by plugin implementations. All code for these are defined in the common support libraries.
  */
 namespace OFX {
@@ -69,6 +69,8 @@ static const char* pluginDescription =
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <iostream>
+#include <vector>
 #include "cv.h"
 #include "cvaux.h"
 #include "highgui.h"
@@ -94,14 +96,21 @@ OfxInteractSuiteV1    *gInteractHost = 0;
 
 #define THRESHOLD1 "threshold1"
 #define THRESHOLD2 "threshold2"
-#define BLOCK_SIZE 1000
+// the block size of the segmentation storages (0 is the OpenCV default, about 64k)
+#define BLOCK_SIZE 0
 
 // private instance data type
 struct MyInstanceData {
   OfxParamHandle threshold1;
   OfxParamHandle threshold2;
-  CvMemStorage* storage;
-  CvSeq *comp;
+  // the segmentation storages that no render is using. Each render takes one, and clears it before giving it back,
+  // so that the memory used by a storage is only what a single frame needs.
+  OfxMutexHandle storageLock;
+  std::vector<CvMemStorage*> storages;
+  // the most memory a storage ever held, in bytes
+  size_t storageHighWater;
+  // the working images, kept from one render to the next
+  ScratchImageCache *scratch;
 };
 
 // Convinience wrapper to get private data 
@@ -150,8 +159,11 @@ createInstance( OfxImageEffectHandle effect)
   stat = gParamHost->paramGetHandle(paramSet, THRESHOLD2, &myData->threshold2, 0);
   OFX::throwSuiteStatusException(stat);
 
-  myData->storage = cvCreateMemStorage ( BLOCK_SIZE );
-  myData->comp = NULL;
+  myData->storageLock = 0;
+  myData->storageHighWater = 0;
+  myData->scratch = new ScratchImageCache(gThreadHost);
+  stat = gThreadHost->mutexCreate(&myData->storageLock, 0);
+  OFX::throwSuiteStatusException(stat);
 
   // set my private instance data
   stat = gPropHost->propSetPointer(effectProps, kOfxPropInstanceData, 0, (void *) myData);
@@ -168,11 +180,46 @@ destroyInstance( OfxImageEffectHandle  effect)
   // get my instance data
   MyInstanceData *myData = getMyInstanceData(effect);
 
-  cvReleaseMemStorage(&(myData->storage));
-
   // and delete it
-  if(myData)
+  if(myData) {
+    for(size_t i = 0; i < myData->storages.size(); i++) {
+      cvReleaseMemStorage(&myData->storages[i]);
+    }
+    if(myData->storageLock) {
+      gThreadHost->mutexDestroy(myData->storageLock);
+    }
+    delete myData->scratch;
     delete myData;
+  }
+
+  return kOfxStatOK;
+}
+
+
+
+
+// release the scratch images and the idle segmentation storages, and log the most memory a storage held
+static OfxStatus
+purgeCaches( OfxImageEffectHandle  effect)
+{
+  MyInstanceData *myData = getMyInstanceData(effect);
+
+  if(myData) {
+    myData->scratch->purge();
+
+    std::vector<CvMemStorage*> storages;
+    gThreadHost->mutexLock(myData->storageLock);
+    storages.swap(myData->storages);
+    size_t highWater = myData->storageHighWater;
+    gThreadHost->mutexUnLock(myData->storageLock);
+    if(gMessageSuite) {
+      gMessageSuite->message(effect, kOfxMessageLog, "", "segment: segmentation storage high-water mark %lu bytes",
+                             (unsigned long)highWater);
+    }
+    for(size_t i = 0; i < storages.size(); i++) {
+      cvReleaseMemStorage(&storages[i]);
+    }
+  }
 
   return kOfxStatOK;
 }
@@ -184,7 +231,7 @@ destroyInstance( OfxImageEffectHandle  effect)
 inline OfxRGBAColourB *
 pixelAddress(OfxRGBAColourB *img, OfxRectI rect, int x, int y, int bytesPerLine)
 {  
-  if(x < rect.x1 || x >= rect.x2 || y < rect.y1 || y > rect.y2)
+  if(x < rect.x1 || x >= rect.x2 || y < rect.y1 || y >= rect.y2)
     return 0;
   OfxRGBAColourB *pix = (OfxRGBAColourB *) (((char *) img) + (y - rect.y1) * bytesPerLine);
   pix += x - rect.x1;  
@@ -193,6 +240,55 @@ pixelAddress(OfxRGBAColourB *img, OfxRectI rect, int x, int y, int bytesPerLine)
 
 
 
+// the memory held by a storage, in bytes
+static size_t
+storageBytes(const CvMemStorage *storage)
+{
+  size_t bytes = 0;
+  for(const CvMemBlock *block = storage->bottom; block; block = block->next) {
+    bytes += storage->block_size;
+  }
+  return bytes;
+}
+
+// a segmentation storage, taken from the instance for the time of one render
+class StorageLease {
+public:
+  StorageLease(MyInstanceData *myData)
+    : _myData(myData)
+    , _storage(0)
+  {
+    gThreadHost->mutexLock(_myData->storageLock);
+    if(!_myData->storages.empty()) {
+      _storage = _myData->storages.back();
+      _myData->storages.pop_back();
+    }
+    gThreadHost->mutexUnLock(_myData->storageLock);
+    if(!_storage) {
+      _storage = cvCreateMemStorage( BLOCK_SIZE );
+    }
+  }
+
+  // give the cleared storage back to the instance, so that its blocks are reused by the next render
+  ~StorageLease()
+  {
+    size_t bytes = storageBytes(_storage);
+    cvClearMemStorage(_storage);
+    gThreadHost->mutexLock(_myData->storageLock);
+    _myData->storages.push_back(_storage);
+    if(bytes > _myData->storageHighWater) {
+      _myData->storageHighWater = bytes;
+    }
+    gThreadHost->mutexUnLock(_myData->storageLock);
+  }
+
+  CvMemStorage *storage() const { return _storage; }
+
+private:
+  MyInstanceData *_myData;
+  CvMemStorage *_storage;
+};
+
 // the process code  that the host sees
 static OfxStatus render(OfxImageEffectHandle instance,
                         OfxPropertySetHandle inArgs,
@@ -285,47 +381,65 @@ static OfxStatus render(OfxImageEffectHandle instance,
 
     CvSize reducedImageSize = cvSize(imgSrc->width,imgSrc->height);
 
-    IplImage *image0 = cvCreateImage( reducedImageSize, IPL_DEPTH_8U, 3);
-    IplImage *image1 = cvCreateImage( reducedImageSize, IPL_DEPTH_8U, 3);
+    ScratchImage scratch0(*myData->scratch, reducedImageSize, IPL_DEPTH_8U, 3);
+    ScratchImage scratch1(*myData->scratch, reducedImageSize, IPL_DEPTH_8U, 3);
+    IplImage *image0 = scratch0.get();
+    IplImage *image1 = scratch1.get();
 
     cvCvtColor( imgSrc , image0, CV_RGBA2RGB );
     cvCvtColor( imgSrc , image1, CV_RGBA2RGB );
 
     // perform the segmentation
 
-    cvPyrSegmentation(image0, 
-		      image1, 
-		      myData->storage, 
-		      &(myData->comp),
-                      level, 
-		      (int)t1, 
-		      (int)t2);    
+    CvSeq *comp = NULL;
+    {
+      StorageLease lease(myData);
+      cvPyrSegmentation(image0, 
+			image1, 
+			lease.storage(), 
+			&comp,
+			level, 
+			(int)t1, 
+			(int)t2);    
+    }
 
 
-    // we need to be careful when writing back because the segmented image is smaller
+    // we need to be careful when writing back because the segmented image is smaller: the few pixels
+    // past its right and top edges are copied from the source
 
-    for(int y = renderWindow.y1; y < (renderWindow.y1 + image1->height); y++) {
+    for(int y = renderWindow.y1; y < renderWindow.y2; y++) {
         if(gEffectHost->abort(instance)) break;
 
 	OfxRGBAColourB *dstPix = pixelAddress(dst, dstRect, renderWindow.x1, y, dstRowBytes);
-	unsigned char *srcPix = (unsigned char*)(image1->imageData + y * image1->widthStep + renderWindow.x1);
+	if(!dstPix) continue;
+	int iy = y - srcRect.y1;
 
-        for(int x = renderWindow.x1; x < (renderWindow.x1 + image1->width); x++) {
-        
+        for(int x = renderWindow.x1; x < renderWindow.x2; x++) {
+	    int ix = x - srcRect.x1;
+	    if(iy >= 0 && iy < image1->height && ix >= 0 && ix < image1->width) {
+		unsigned char *srcPix = (unsigned char*)(image1->imageData + iy * image1->widthStep + 3 * ix);
                 dstPix->r = srcPix[0];
                 dstPix->g = srcPix[1];
                 dstPix->b = srcPix[2];
                 dstPix->a = 255;
+	    } else {
+		OfxRGBAColourB *srcPix = pixelAddress((OfxRGBAColourB *) srcPtr, srcRect, x, y, srcRowBytes);
+		if(srcPix) {
+		    dstPix->r = srcPix->r;
+		    dstPix->g = srcPix->g;
+		    dstPix->b = srcPix->b;
+		    dstPix->a = 255;
+		} else {
+		    dstPix->r = dstPix->g = dstPix->b = dstPix->a = 0;
+		}
+	    }
 
 	    dstPix++;
-	    srcPix=srcPix+3;
         }
     }
 
     // just release the header but not the image itself. That will be done later.
     cvReleaseImageHeader(&imgSrc);
-    cvReleaseImage(&image0);
-    cvReleaseImage(&image1);
   
     // we are finished with the source images so release them
     stat = gEffectHost->clipReleaseImage(sourceImg);
@@ -340,6 +454,31 @@ static OfxStatus render(OfxImageEffectHandle instance,
 
 
 
+// the pyramid segmentation links the regions across the whole frame, so every render window needs all of the source
+static OfxStatus
+getRegionsOfInterest(OfxImageEffectHandle instance,
+		     OfxPropertySetHandle inArgs,
+		     OfxPropertySetHandle outArgs)
+{
+  OfxTime time;
+  OfxRectD rod;
+  OfxStatus stat;
+
+  stat = gPropHost->propGetDouble(inArgs, kOfxPropTime, 0, &time);
+  OFX::throwSuiteStatusException(stat);
+
+  OfxImageClipHandle sourceClip = 0;
+  stat = gEffectHost->clipGetHandle(instance, kOfxImageEffectSimpleSourceClipName, &sourceClip, 0);
+  OFX::throwSuiteStatusException(stat);
+  stat = gEffectHost->clipGetRegionOfDefinition(sourceClip, time, &rod);
+  OFX::throwSuiteStatusException(stat);
+
+  stat = gPropHost->propSetDoubleN(outArgs, kOfxImageClipPropRoI "_" kOfxImageEffectSimpleSourceClipName, 4, &rod.x1);
+  OFX::throwSuiteStatusException(stat);
+
+  return kOfxStatOK;
+}
+
 //  describe the plugin in context
 static OfxStatus
 describeInContext( OfxImageEffectHandle  effect,  OfxPropertySetHandle inArgs)
@@ -447,12 +586,16 @@ describe(OfxImageEffectHandle effect)
   // set a few flags
   stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPluginPropSingleInstance, 0, int(false));
   OFX::throwSuiteStatusException(stat);
-  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPluginPropHostFrameThreading, 0, int(false));
+  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPluginPropHostFrameThreading, 0, int(true));
   OFX::throwSuiteStatusException(stat);
-  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsMultiResolution, 0, int(false));
+  stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsMultiResolution, 0, int(true));
   OFX::throwSuiteStatusException(stat);
+  // every render segments the whole source, so tiles would only repeat that work
   stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropSupportsTiles, 0, int(false));
   OFX::throwSuiteStatusException(stat);
+  // each render has its own segmentation storage, so any number of renders may run at the same time
+  stat = gPropHost->propSetString(effectProps, kOfxImageEffectPluginRenderThreadSafety, 0, kOfxImageEffectRenderFullySafe);
+  OFX::throwSuiteStatusException(stat);
   stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPropTemporalClipAccess, 0, int(false));
   OFX::throwSuiteStatusException(stat);
   stat = gPropHost->propSetInt(effectProps, kOfxImageEffectPluginPropFieldRenderTwiceAlways, 0, int(true));
@@ -495,10 +638,14 @@ pluginMain(const char *action,  const void *handle, OfxPropertySetHandle inArgs,
             return describeInContext(effect, inArgs);
         } else if(strcmp(action, kOfxImageEffectActionRender) == 0) {
             return render(effect, inArgs, outArgs);
+        } else if(strcmp(action, kOfxImageEffectActionGetRegionsOfInterest) == 0) {
+            return getRegionsOfInterest(effect, inArgs, outArgs);
         } else if(strcmp(action, kOfxActionCreateInstance) == 0) {
             return createInstance(effect);
         } else if(strcmp(action, kOfxActionDestroyInstance) == 0) {
             return destroyInstance(effect);
+        } else if(strcmp(action, kOfxActionPurgeCaches) == 0) {
+            return purgeCaches(effect);
         }
     } catch (const OFX::Exception::Suite &e) {
         std::cout << "OFX Plugin Suite error: " << e.what() << std::endl;